@@ -0,0 +1,118 @@
+/*
+ * bitbench.c - microbenchmark of bitmap.h's free-slot search
+ *
+ * A slab of SLOTS slots keeps a bitmap with a bit set for every free
+ * slot. The slab is filled to a given occupancy at random, then every
+ * round allocates the lowest free slot and frees a random allocated
+ * one, so the occupancy holds. Each round is timed with three searches:
+ * testing bit by bit, counting trailing zeros a word at a time, and
+ * bitmap_next (which skips zero words 256 bits at a time, with AVX2
+ * when the CPU has it).
+ *
+ * Build and run with "make bitbench; ./bitbench".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bitmap.h"
+
+#define ROUNDS 200000
+
+static const int slots[] = {512, 4096, 32768};
+static const double occupancy[] = {0.50, 0.90, 0.99, 0.999};
+
+/* The first set bit, testing one bit at a time */
+static int next_bitwise(const uint64_t *map, int n, int i)
+{
+    for (; i < n; i++)
+	if (bitmap_test(map, i))
+	    return i;
+    return n;
+}
+
+/* The first set bit, one word at a time */
+static int next_wordwise(const uint64_t *map, int n, int i)
+{
+    int w = i >> 6, nw = BITMAP_WORDS(n);
+    uint64_t bits;
+
+    if (i >= n)
+	return n;
+    for (bits = map[w] & (~(uint64_t)0 << (i & 63)); bits == 0; bits = map[w])
+	if (++w >= nw)
+	    return n;
+    return (w << 6) + __builtin_ctzll(bits);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * run - ns per allocate/free round on an n-slot slab at occupancy occ,
+ *     finding free slots with next
+ */
+static double run(int n, double occ, int (*next)(const uint64_t *, int, int))
+{
+    uint64_t *map;
+    int *used, nused, i, k, slot;
+    double start, secs;
+
+    if ((map = calloc(BITMAP_WORDS(n), sizeof(uint64_t))) == NULL ||
+	(used = malloc(n * sizeof(int))) == NULL) {
+	perror("bitbench");
+	exit(1);
+    }
+
+    /* All free, then allocate a random occ of the slots */
+    for (i = 0; i < n; i++)
+	bitmap_set(map, i);
+    srand(1);
+    for (nused = 0; nused < (int)(occ * n); ) {
+	slot = rand() % n;
+	if (bitmap_test(map, slot)) {
+	    bitmap_clear(map, slot);
+	    used[nused++] = slot;
+	}
+    }
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+	if ((slot = next(map, n, 0)) == n)
+	    break;
+	bitmap_clear(map, slot);
+	k = rand() % (nused + 1);
+	used[nused] = slot;
+	bitmap_set(map, used[k]);
+	used[k] = used[nused];
+    }
+    secs = now() - start;
+
+    free(map);
+    free(used);
+    return secs / ROUNDS * 1e9;
+}
+
+int main(void)
+{
+    int s, o;
+
+    printf("%6s %6s %12s %12s %12s\n", "slots", "occ", "bitwise ns",
+	   "tzcnt ns", "bitmap ns");
+    for (s = 0; s < (int)(sizeof(slots) / sizeof(slots[0])); s++) {
+	for (o = 0; o < (int)(sizeof(occupancy) / sizeof(occupancy[0])); o++) {
+	    printf("%6d %5.1f%% %12.1f %12.1f %12.1f\n", slots[s],
+		   occupancy[o] * 100,
+		   run(slots[s], occupancy[o], next_bitwise),
+		   run(slots[s], occupancy[o], next_wordwise),
+		   run(slots[s], occupancy[o], bitmap_next));
+	    fflush(stdout);
+	}
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * bitmap.h - bitmaps of 64-bit words, searched a word at a time
+ *
+ * bitmap_next finds the next set bit with one count-trailing-zeros
+ * (tzcnt/bsf) on the first non-zero word, never bit by bit. Runs of
+ * zero words are skipped 256 bits at a time: with one AVX2 test on a
+ * CPU that has it, with an OR of four words otherwise. Like memops.c,
+ * the AVX2 loop is compiled with a target attribute and picked at run
+ * time, so the rest of the program keeps the baseline flags. Bits past
+ * n in the last word must stay clear.
+ *
+ * mm.c keeps a bitmap of its non-empty free lists; that map is a single
+ * word, so mm never reaches the 256-bit skip, AVX2 or not. bitbench.c
+ * measures the search on slab-sized maps, where it matters.
+ */
+#include <stdint.h>
+#if defined(__i386__) || defined(__x86_64__)
+#define BITMAP_X86
+#include <immintrin.h>
+#endif
+
+/* Words in a bitmap of n bits */
+#define BITMAP_WORDS(n)  (((n) + 63) / 64)
+
+static inline void bitmap_set(uint64_t *map, int i)
+{
+    map[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static inline void bitmap_clear(uint64_t *map, int i)
+{
+    map[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
+static inline int bitmap_test(const uint64_t *map, int i)
+{
+    return (map[i >> 6] >> (i & 63)) & 1;
+}
+
+#ifdef BITMAP_X86
+/* Skip zero words 4 at a time from word w, with AVX2 */
+__attribute__((target("avx2")))
+static int bitmap_skip_avx2(const uint64_t *map, int nw, int w)
+{
+    while (w + 4 <= nw) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(map + w));
+	if (!_mm256_testz_si256(v, v))
+	    break;
+	w += 4;
+    }
+    return w;
+}
+#endif
+
+/* The last set bit of an n-bit map, -1 if none */
+static inline int bitmap_last(const uint64_t *map, int n)
+{
+    int w;
+
+    for (w = BITMAP_WORDS(n) - 1; w >= 0; w--)
+	if (map[w] != 0)
+	    return (w << 6) + 63 - __builtin_clzll(map[w]);
+    return -1;
+}
+
+/* The first set bit at or after bit i of an n-bit map, n if none */
+static inline int bitmap_next(const uint64_t *map, int n, int i)
+{
+    int w = i >> 6, nw = BITMAP_WORDS(n);
+    uint64_t bits;
+
+    if (i >= n)
+	return n;
+    bits = map[w] & (~(uint64_t)0 << (i & 63));
+    while (bits == 0) {
+	if (++w >= nw)
+	    return n;
+#ifdef BITMAP_X86
+	// libgcc fills in the CPU model before main, so this is one load
+	if (w + 4 <= nw && __builtin_cpu_supports("avx2"))
+	    w = bitmap_skip_avx2(map, nw, w);
+#endif
+	while (w + 4 <= nw && (map[w] | map[w+1] | map[w+2] | map[w+3]) == 0)
+	    w += 4;
+	if (w >= nw)
+	    return n;
+	bits = map[w];
+    }
+    return (w << 6) + __builtin_ctzll(bits);
+}
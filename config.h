@@ -58,15 +58,18 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes. memlib only reserves this much address
+ * space up front and commits pages as the heap grows, so it can be big:
+ * 1 GB in a 32-bit build, 64 GB in a 64-bit one.
  */
-#define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#define MAX_HEAP ((size_t)1 << (sizeof(void *) == 4 ? 30 : 36))
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
 #define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+#define USE_CLOCK  1   /* rdtscp or CLOCK_MONOTONIC_RAW, median of many runs */
 
 #endif /* __CONFIG_H */
@@ -9,6 +9,9 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+#if USE_CLOCK
+static ftimer_stats_t last; /* spread of the runs in the last fsecs() */
+#endif
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -36,6 +39,13 @@ void init_fsecs(void)
 #elif USE_GETTOD
     if (verbose)
 	printf("Measuring performance with gettimeofday().\n");
+#elif USE_CLOCK
+    if (ftimer_clock_init()) {
+	if (verbose)
+	    printf("Measuring performance with rdtscp (invariant TSC).\n");
+    }
+    else if (verbose)
+	printf("Measuring performance with CLOCK_MONOTONIC_RAW.\n");
 #endif
 }
 
@@ -51,7 +61,26 @@ double fsecs(fsecs_test_funct f, void *argp)
     return ftimer_itimer(f, argp, 10);
 #elif USE_GETTOD
     return ftimer_gettod(f, argp, 10);
+#elif USE_CLOCK
+    return ftimer_clock(f, argp, &last);
 #endif 
 }
 
+/*
+ * fsecs_spread - Describe the runs behind the last fsecs() call
+ */
+int fsecs_spread(fsecs_spread_t *sp)
+{
+#if USE_CLOCK
+    sp->runs = last.runs;
+    sp->min = last.min;
+    sp->mean = last.mean;
+    sp->median = last.median;
+    sp->sd = last.sd;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 
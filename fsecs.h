@@ -2,3 +2,16 @@ typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+
+/* Spread of the runs behind the most recent fsecs() call */
+typedef struct {
+    int runs;       /* number of timed runs */
+    double min;     /* fastest run in seconds */
+    double mean;    /* mean run in seconds */
+    double median;  /* median run in seconds */
+    double sd;      /* sample standard deviation in seconds */
+} fsecs_spread_t;
+
+/* Fill *sp and return 1 if the timer measures each run separately
+   (USE_CLOCK), else return 0 */
+int fsecs_spread(fsecs_spread_t *sp);
@@ -7,11 +7,22 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_clock: version that uses rdtscp or CLOCK_MONOTONIC_RAW
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
 #include <sys/time.h>
 #include "ftimer.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
 /* function prototypes */
 static void init_etime(void);
 static double get_etime(void);
@@ -52,6 +63,146 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     return (1E-3*diff);
 }
 
+/*
+ * Parameters for ftimer_clock: enough runs to fill CLOCK_MIN_SECS, but
+ * at least CLOCK_MIN_RUNS and at most CLOCK_MAX_RUNS of them, after
+ * CLOCK_WARMUP untimed runs to fault in the heap and warm the caches.
+ */
+#define CLOCK_WARMUP    2
+#define CLOCK_MIN_RUNS  11
+#define CLOCK_MAX_RUNS  1001
+#define CLOCK_MIN_SECS  0.05
+
+static double tsc_hz = 0;  /* calibrated TSC frequency; 0 = use clock */
+
+static double clock_now(void);
+
+/*
+ * ftimer_clock_init - Use the TSC if the CPU says it is invariant (runs
+ *    at a constant rate in every P- and C-state), calibrating it against
+ *    CLOCK_MONOTONIC_RAW over 20 ms. Otherwise use the raw clock itself.
+ */
+int ftimer_clock_init(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int lo, hi, aux;
+    unsigned long long c0, c1;
+    struct timespec t0, t1, now;
+    double secs;
+
+    tsc_hz = 0;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+	return 0;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 27)))
+	return 0; /* no rdtscp */
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+    __asm__ volatile ("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+    c0 = ((unsigned long long)hi << 32) | lo;
+    do {
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    } while ((now.tv_sec - t0.tv_sec) + 1e-9*(now.tv_nsec - t0.tv_nsec) < 0.02);
+    __asm__ volatile ("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+    c1 = ((unsigned long long)hi << 32) | lo;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+
+    secs = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+    tsc_hz = (c1 - c0) / secs;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * ftimer_clock - Pin the calling thread to the CPU it is running on,
+ *    do the warmup runs, then time each run of f(argp) individually.
+ *    Return the median; the min and standard deviation go in *stats.
+ */
+double ftimer_clock(ftimer_test_funct f, void *argp, ftimer_stats_t *stats)
+{
+    double samples[CLOCK_MAX_RUNS];
+    double start, mean = 0, var = 0, median;
+    int i, n;
+#ifdef __linux__
+    cpu_set_t oldmask, mask;
+    int pinned = 0, cpu;
+
+    if ((cpu = sched_getcpu()) >= 0 && 
+	sched_getaffinity(0, sizeof(oldmask), &oldmask) == 0) {
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	pinned = (sched_setaffinity(0, sizeof(mask), &mask) == 0);
+    }
+#endif
+
+    for (i = 0; i < CLOCK_WARMUP; i++) {
+	start = clock_now();
+	f(argp);
+	samples[0] = clock_now() - start;
+    }
+
+    /* Size the run count from the last warmup run */
+    if (samples[0] > 0)
+	n = (int)(CLOCK_MIN_SECS / samples[0]);
+    else
+	n = CLOCK_MAX_RUNS;
+    n = (n < CLOCK_MIN_RUNS) ? CLOCK_MIN_RUNS : n;
+    n = (n > CLOCK_MAX_RUNS) ? CLOCK_MAX_RUNS : n;
+
+    for (i = 0; i < n; i++) {
+	start = clock_now();
+	f(argp);
+	samples[i] = clock_now() - start;
+	mean += samples[i];
+    }
+
+#ifdef __linux__
+    if (pinned)
+	sched_setaffinity(0, sizeof(oldmask), &oldmask);
+#endif
+
+    mean /= n;
+    for (i = 0; i < n; i++)
+	var += (samples[i] - mean) * (samples[i] - mean);
+    qsort(samples, n, sizeof(double), ftimer_dbl_cmp);
+    median = (n % 2) ? samples[n/2] : (samples[n/2 - 1] + samples[n/2]) / 2;
+
+    if (stats) {
+	stats->runs = n;
+	stats->min = samples[0];
+	stats->mean = mean;
+	stats->median = median;
+	stats->sd = sqrt(var / (n - 1));
+    }
+    return median;
+}
+
+/* clock_now - Current time in seconds from the TSC or the raw clock */
+static double clock_now(void)
+{
+    struct timespec ts;
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int lo, hi, aux;
+
+    if (tsc_hz > 0) {
+	__asm__ volatile ("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+	return (((unsigned long long)hi << 32) | lo) / tsc_hz;
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/* ftimer_dbl_cmp - qsort comparison for doubles */
+int ftimer_dbl_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
 
 /*
  * Routines for manipulating the Unix interval timer
@@ -12,3 +12,24 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+
+/* Spread of the runs measured by ftimer_clock */
+typedef struct {
+    int runs;       /* number of timed runs (after warmup) */
+    double min;     /* fastest run in seconds */
+    double mean;    /* mean run in seconds */
+    double median;  /* median run in seconds */
+    double sd;      /* sample standard deviation in seconds */
+} ftimer_stats_t;
+
+/* Pick and calibrate the clock used by ftimer_clock. Return 1 if it
+   uses the invariant TSC, 0 if it uses CLOCK_MONOTONIC_RAW */
+int ftimer_clock_init(void);
+
+/* Estimate the running time of f(argp) with rdtscp or CLOCK_MONOTONIC_RAW,
+   pinned to one CPU after warmup. Return the median of the runs and
+   describe their spread in *stats (if not NULL) */
+double ftimer_clock(ftimer_test_funct f, void *argp, ftimer_stats_t *stats);
+
+/* qsort comparison for doubles, ascending */
+int ftimer_dbl_cmp(const void *a, const void *b);
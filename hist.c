@@ -0,0 +1,103 @@
+/*
+ * hist.c - log-bucketed latency histograms (HDR style)
+ */
+#include <string.h>
+#include <time.h>
+#include "hist.h"
+
+/* 
+ * hist_index - Map a value to its bucket. The top HIST_SUBBITS bits
+ *    below the most significant bit select the sub-bucket.
+ */
+static int hist_index(uint64_t v)
+{
+    int shift;
+
+    if (v < HIST_SUB)
+	return (int)v;
+    shift = (63 - __builtin_clzll(v)) - HIST_SUBBITS;
+    return ((shift + 1) << HIST_SUBBITS) + (int)((v >> shift) & (HIST_SUB-1));
+}
+
+/* 
+ * hist_value - The midpoint of the range of values that map to bucket i
+ */
+static uint64_t hist_value(int i)
+{
+    int shift;
+
+    if (i < HIST_SUB)
+	return i;
+    shift = (i >> HIST_SUBBITS) - 1;
+    return ((uint64_t)(HIST_SUB + (i & (HIST_SUB-1))) << shift) + 
+	((1ULL << shift) >> 1);
+}
+
+/*
+ * hist_reset - Clear all samples
+ */
+void hist_reset(hist_t *h)
+{
+    memset(h, 0, sizeof(hist_t));
+}
+
+/*
+ * hist_record - Record one sample
+ */
+void hist_record(hist_t *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+	h->max = v;
+}
+
+/*
+ * hist_merge - Add all samples of src into dst
+ */
+void hist_merge(hist_t *dst, hist_t *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+	dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+	dst->max = src->max;
+}
+
+/*
+ * hist_percentile - Return the value at percentile p. The top bucket
+ *    is clamped to the exact maximum so p100 is never overstated.
+ */
+uint64_t hist_percentile(hist_t *h, double p)
+{
+    uint64_t rank, seen = 0;
+    uint64_t v;
+    int i;
+
+    if (h->total == 0)
+	return 0;
+    rank = (uint64_t)(p / 100.0 * h->total + 0.5);
+    if (rank < 1)
+	rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	seen += h->counts[i];
+	if (seen >= rank) {
+	    v = hist_value(i);
+	    return (v > h->max) ? h->max : v;
+	}
+    }
+    return h->max;
+}
+
+/*
+ * hist_now - Current monotonic time in nanoseconds
+ */
+uint64_t hist_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
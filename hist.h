@@ -0,0 +1,34 @@
+/*
+ * hist.h - log-bucketed latency histograms (HDR style)
+ *
+ * Values are recorded in nanoseconds. Values below HIST_SUB land in
+ * exact buckets; above that every power of two is split into HIST_SUB
+ * linear sub-buckets, so the relative error of a reported percentile
+ * is bounded by 1/HIST_SUB.
+ */
+#include <stdint.h>
+
+#define HIST_SUBBITS 4
+#define HIST_SUB     (1 << HIST_SUBBITS)
+#define HIST_BUCKETS ((64 - HIST_SUBBITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS]; /* number of samples per bucket */
+    uint64_t total;                /* number of samples recorded */
+    uint64_t max;                  /* largest sample recorded */
+} hist_t;
+
+/* Clear all samples */
+void hist_reset(hist_t *h);
+
+/* Record one sample of v nanoseconds */
+void hist_record(hist_t *h, uint64_t v);
+
+/* Add all samples of src into dst */
+void hist_merge(hist_t *dst, hist_t *src);
+
+/* Return the value at percentile p (0 < p <= 100), 0 if empty */
+uint64_t hist_percentile(hist_t *h, double p);
+
+/* Current time in nanoseconds, for timestamping single operations */
+uint64_t hist_now(void);
@@ -15,10 +15,17 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <math.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "ftimer.h"
+#include "hist.h"
+#include "perfctr.h"
+#include "memops.h"
 #include "config.h"
 
 /**********************
@@ -72,15 +79,147 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* 
+ * Blocks freed in cross-thread mode (-x) are batched up locally and then
+ * handed to the next thread's mailbox, which that thread drains and frees.
+ */
+#define MT_BATCH 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    char **ptrs;         /* blocks waiting to be freed by the owning thread */
+    int count;           /* number of blocks in ptrs; written under lock,
+			    polled by the owner with an atomic load */
+    int capacity;        /* allocated length of ptrs */
+} mailbox_t;
+
+/* Per-thread state for the multi-threaded replay (-j) */
+typedef struct mtarg {
+    trace_t *trace;      /* trace to replay; ops are shared read-only */
+    char **blocks;       /* private block array, so id spaces are disjoint */
+    int libc;            /* replay against libc malloc instead of mm */
+    int tid;             /* thread index in [0, nthreads) */
+    int nthreads;        /* number of replay threads */
+    int cross;           /* hand frees to the next thread (-x) */
+    mailbox_t *boxes;    /* one mailbox per thread (cross mode only) */
+    pthread_barrier_t *start; /* lines threads up before the clock starts */
+    pthread_barrier_t *done;  /* all replays finished, drain mailboxes */
+    char *outbox[MT_BATCH];   /* frees not yet posted to the next thread */
+    int nout;
+    double t0, t1;       /* start/end timestamps of this thread's replay */
+} mtarg_t;
+
+/*
+ * The false-sharing benchmark (-S). Threads take turns allocating
+ * SHARE_OBJS objects of SHARE_SIZE bytes, so that a shared heap hands
+ * neighbouring blocks to different threads, then each thread bumps a
+ * counter in every one of its objects SHARE_ITERS times.
+ */
+#define SHARE_OBJS  16
+#define SHARE_SIZE  16
+#define SHARE_ITERS 2000000
+
+typedef struct {
+    int tid;             /* thread index in [0, nthreads) */
+    int nthreads;
+    int hot;             /* allocate with mm_malloc_hot */
+    volatile int *turn;  /* allocations so far; tid's turn when it is tid mod n */
+    pthread_barrier_t *start; /* all objects allocated, start writing */
+    char *objs[SHARE_OBJS];
+    double t0, t1;       /* start/end timestamps of the writes */
+} sharearg_t;
+
+/*
+ * The small-block cache benchmark (-k). Each thread does CACHE_ITERS
+ * random mallocs and frees of up to CACHE_SIZE bytes over CACHE_BLOCKS
+ * slots, then frees the rest and waits, so that whatever mm still has
+ * allocated is in its caches. With -c it is also a stress test: each
+ * block is filled with its own byte and checked before it is freed,
+ * and mm_check runs once the caches are full and again after the
+ * threads exit.
+ */
+#define CACHE_BLOCKS 64
+#define CACHE_ITERS  100000
+#define CACHE_SIZE   256
+#define CACHE_STACK  (64 * 1024)  /* thread stack size, for many threads */
+
+typedef struct {
+    int tid;
+    int check;                /* fill and verify payloads (-c) */
+    long bad;                 /* blocks found overwritten */
+    pthread_barrier_t *start; /* all threads created */
+    pthread_barrier_t *done;  /* all blocks freed, main thread measures */
+    pthread_barrier_t *leave; /* main thread has measured */
+    double t0, t1;            /* start/end timestamps of the ops */
+} cachearg_t;
+
+/* 
+ * Per-op latency histograms for one trace (-L), split by request type
+ * and by payload size class: <=64, <=512, <=4096 and larger.
+ */
+#define LAT_NCLASS 4
+
+typedef struct {
+    hist_t op[3][LAT_NCLASS]; /* indexed by traceop_t type, then size class */
+    hist_t all;               /* every request in the trace */
+} lat_t;
+
+/* 
+ * One heap-shape sample taken by the fragmentation pass (-F). Free
+ * blocks are binned by size: bin i holds sizes in [2^(i+4), 2^(i+5)),
+ * with the last bin open-ended.
+ */
+#define FRAG_NBINS 16
+#define FRAG_NLISTS 64
+
+typedef struct {
+    int op;              /* number of requests replayed so far */
+    size_t heapsize;     /* current heap size */
+    size_t live;         /* requested payload bytes in allocated blocks */
+    size_t tags;         /* boundary tag bytes in allocated blocks */
+    size_t rounding;     /* alignment and minimum-size padding */
+    size_t freebytes;    /* bytes in free blocks */
+    size_t largest;      /* largest free block */
+    int nfree;           /* number of free blocks */
+    int bins[FRAG_NBINS];/* free-block size histogram */
+    int nlists;          /* number of free lists reported by mm */
+    size_t lists[FRAG_NLISTS]; /* length of each free list */
+} frag_t;
+
+/* A live block and its requested size, sorted by address for the walk */
+typedef struct {
+    char *p;
+    size_t size;
+} liveblk_t;
+
+/* What frag_visit needs to account for each block */
+typedef struct {
+    frag_t *f;           /* sample being filled in */
+    liveblk_t *live;     /* live blocks, sorted by address */
+    int nlive;           /* number of live blocks */
+} fragwalk_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    int runs;        /* number of timed runs behind secs */
+    double secs_min; /* fastest of those runs */
+    double secs_median; /* median of those runs */
+    double secs_sd;  /* sample standard deviation of those runs */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t heapsize; /* heap high-water mark after the utilization run */
+    int sbrks;       /* mem_sbrk calls made during the utilization run */
+
+    /* defined only with -L */
+    lat_t *lat;      /* per-op latency histograms */
+
+    /* defined only with -P */
+    perf_counts_t *hw; /* hardware counters for one untimed replay */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -100,6 +239,13 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* With -M, the heaps a trace's blocks are spread over (heaps[0] = main) */
+static int nheaps = 1;
+static mm_heap_t **heaps = NULL;
+
+/* With -K, the passes that allocate with mm_calloc rather than mm_malloc */
+static int use_calloc = 0;
+
 
 /********************* 
  * Function prototypes 
@@ -121,9 +267,79 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges,
+			 int heapcheck);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void reset_heaps(void);
+static void drop_heaps(void);
+static void *trace_malloc(int index, int size);
+
+/* Routines for the instrumented per-op latency replay (-L) */
+static void eval_lat(trace_t *trace, int libc, lat_t *lat);
+static int lat_class(int size);
+static void printlatency(int n, char **tracefiles, stats_t *stats);
+
+/* Routines for the fragmentation and heap-shape pass (-F) */
+static void eval_frag(trace_t *trace, int tracenum, int interval);
+static void frag_sample(trace_t *trace, int op, frag_t *f);
+static void frag_visit(const mm_block_t *blk, void *arg);
+static void printfrag(frag_t *f, int header);
+static int liveblk_cmp(const void *a, const void *b);
+
+/* Routine for the sampled heap profile (-p) */
+static void eval_prof(trace_t *trace, int tracenum, int rate);
+
+/* Routines for comparing all of mm's engines (-e all) or knob values (-O) */
+static void eval_engines(char *tracedir, char **tracefiles, int n);
+static void eval_sweep(char *tracedir, char **tracefiles, int n, char *opt);
+static void eval_row(const char *label, trace_t **traces, int n);
+
+/* Routine for comparing 4K and huge pages under the heap (-T) */
+static void eval_pages(char *tracedir, char **tracefiles, int n);
+
+/* Routine for comparing the copy and zero kernels (-K) */
+static void eval_kernels(char *tracedir, char **tracefiles, int n);
+
+/* Routines for the hardware counter replay (-P) */
+static perf_counts_t *eval_hw(fsecs_test_funct f, speed_t *params);
+static void printcounters(int n, stats_t *stats);
+
+/* Routines for replaying traces concurrently from several threads (-j) */
+static void eval_mt(char **tracefiles, int num_tracefiles, int nthreads,
+		    int cross, int run_libc);
+static double mt_run(trace_t **traces, int nthreads, int cross, int libc,
+		     mtarg_t *args);
+static void *mt_replay(void *vargp);
+static void mt_free(mtarg_t *arg, char *p);
+static void mt_post(mtarg_t *arg);
+static void mt_drain(mtarg_t *arg);
+static double mt_now(void);
+
+/* Routines for the small-block cache benchmark (-k) */
+static int eval_cache(int nthreads, int heapcheck);
+#ifdef MM_THREADSAFE
+static void *cache_run(void *vargp);
+#endif
+
+/* Routines for the false-sharing benchmark (-S) */
+static void eval_share(int nthreads);
+#ifdef MM_THREADSAFE
+static void *share_run(void *vargp);
+#endif
+
+/* Routines for repeated timing, machine-readable output (-o) and the
+   comparison against a saved baseline (-B) */
+static void time_trace(fsecs_test_funct f, speed_t *params, int runs, 
+		       stats_t *stats);
+static void writeresults(char *spec, int n, char **tracefiles, 
+			 stats_t *libc_stats, stats_t *mm_stats, 
+			 double perfindex);
+static void writestats(FILE *fp, int json, char *name, char *tracefile, 
+		       stats_t *stats);
+static int compare_baseline(char *filename, int n, char **tracefiles, 
+			    stats_t *stats);
+static double t_critical(double df);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -150,15 +366,36 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int nthreads = 0;    /* If set, replay concurrently on -j threads */
+    int cross = 0;       /* If set, free blocks on another thread (-x) */
+    int latency = 0;     /* If set, report per-op latency percentiles (-L) */
+    int hwcount = 0;     /* If set, report hardware counters (-P) */
+    int fraginterval = 0;/* If set, sample the heap shape every -F ops */
+    int profrate = 0;    /* If set, profile the heap sampling every -p bytes */
+    int allengines = 0;  /* If set, compare every mm engine (-e all) */
+    char *sweep = NULL;  /* If set, compare a knob's values (-O k=v:v:...) */
+    int pagecompare = 0; /* If set, compare 4K and huge pages (-T) */
+    int numa = 0;        /* If set, NUMA arenas are on (-N) */
+    int sharethreads = 0;/* If set, run the false-sharing benchmark (-S) */
+    int kernelcompare = 0;/* If set, compare the copy kernels (-K) */
+    int cachethreads = 0;/* If set, run the cache benchmark (-k) */
+    int heapcheck = 0;   /* If set, run mm_check after each op (-c) */
+    int runs = 1;        /* Number of timed runs per trace (-r) */
+    char *outspec = NULL;   /* Machine-readable output format[:file] (-o) */
+    char *baseline = NULL;  /* Baseline CSV to compare against (-B) */
+    int regressions = 0;    /* Significant slowdowns versus the baseline */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
     int numcorrect;
     
+    /* MM_OPTIONS first, so that -O and -e override it */
+    mm_ctl_env();
+
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:j:k:r:o:B:F:G:p:e:H:M:O:S:hvVgalxKLNPcCT")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +421,140 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+	case 'j': /* Replay the traces on this many threads at once */
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'x': /* Cross-thread frees in -j mode */
+	    cross = 1;
+	    break;
+	case 'L': /* Report per-op latency percentiles */
+	    latency = 1;
+	    break;
+	case 'P': /* Report hardware performance counters */
+	    hwcount = 1;
+	    break;
+	case 'r': /* Repeat each timing this many times */
+	    runs = atoi(optarg);
+	    if (runs < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'o': /* Emit machine-readable results */
+	    outspec = optarg;
+	    if (strncmp(outspec, "json", 4) && strncmp(outspec, "csv", 3)) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'B': /* Compare against a baseline saved with -o csv */
+	    baseline = optarg;
+	    break;
+	case 'c': /* Check the whole heap after every request */
+	    heapcheck = 1;
+	    break;
+	case 'C': /* Have mm check the blocks each request touched */
+	    mm_set_check(MM_CHECK_INCR);
+	    break;
+	case 'e': /* Pick one of mm's engines, or list or compare them all */
+	    if (!strcmp(optarg, "list")) {
+		for (i = 0; mm_engine_name(i) != NULL; i++)
+		    printf("%s\n", mm_engine_name(i));
+		exit(0);
+	    }
+	    if (!strcmp(optarg, "all"))
+		allengines = 1;
+	    else if (mm_set_engine(optarg) < 0) {
+		fprintf(stderr, "Unknown engine %s (try -e list)\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'O': /* Set one of mm's knobs, or compare a list of values */
+	    if (strchr(optarg, ',') != NULL) {
+		/* Commas separate knobs in MM_OPTIONS, so don't guess */
+		fprintf(stderr, "One knob per -O, values to compare split by ':' "
+			"(-O %s)\n", optarg);
+		exit(1);
+	    } else if (strchr(optarg, ':') != NULL) {
+		if (sweep != NULL)
+		    app_error("Only one -O can list several values");
+		sweep = optarg;
+	    } else if (mm_ctl_parse(optarg) < 0) {
+		fprintf(stderr, "Bad knob or value in -O %s (see mm.h)\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'H': /* Back the heap with 4k, thp or hugetlb pages */
+	    if (!strcmp(optarg, "thp"))
+		mem_set_pages(MEM_PAGES_THP);
+	    else if (!strcmp(optarg, "hugetlb"))
+		mem_set_pages(MEM_PAGES_HUGETLB);
+	    else if (!strcmp(optarg, "4k"))
+		mem_set_pages(MEM_PAGES_4K);
+	    else {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'T': /* Compare throughput and dTLB misses on 4K and huge pages */
+	    pagecompare = 1;
+	    break;
+	case 'k': /* Run the small-block cache benchmark on this many threads */
+	    cachethreads = atoi(optarg);
+	    if (cachethreads < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'K': /* Compare mm's copy and zero kernels */
+	    kernelcompare = 1;
+	    break;
+	case 'p': /* Dump a sampled heap profile at each trace's peak */
+	    profrate = atoi(optarg);
+	    if (profrate < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'M': /* Spread each trace's blocks over this many heaps */
+	    nheaps = atoi(optarg);
+	    if (nheaps < 1) {
+		usage();
+		exit(1);
+	    }
+	    if ((heaps = (mm_heap_t **)calloc(nheaps, sizeof(mm_heap_t *))) == NULL)
+		unix_error("calloc failed for -M");
+	    break;
+	case 'S': /* Run the false-sharing benchmark on this many threads */
+	    sharethreads = atoi(optarg);
+	    if (sharethreads < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'N': /* Give every NUMA node an mm arena of its own */
+	    mm_set_numa(1);
+	    numa = 1;
+	    break;
+	case 'G': /* Guard large blocks with a PROT_NONE page (DEBUG=1 builds) */
+	    if (mm_set_guard(atoi(optarg)) < 0) {
+		/* Don't let a run that guards nothing pass as a guarded one */
+		printf("Skipping the guard-page run: mm.c was not built with "
+		       "the debug allocator (rebuild with make DEBUG=1)\n");
+		exit(1);
+	    }
+	    break;
+	case 'F': /* Analyze fragmentation every this many requests */
+	    fraginterval = atoi(optarg);
+	    if (fraginterval < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -238,6 +609,52 @@ int main(int argc, char **argv)
     /* Initialize the timing package */
     init_fsecs();
 
+    /* Open the hardware counters, or carry on without them */
+    if (hwcount && perf_init() == 0) {
+	printf("Hardware counters unavailable (perf_event_open failed: %s), "
+	       "ignoring -P\n", strerror(errno));
+	hwcount = 0;
+    }
+
+    /*
+     * The multi-threaded replay is a pure throughput experiment, so it
+     * reports its own table and skips the performance index.
+     */
+    if (nthreads > 0) {
+	if (cross && nthreads < 2)
+	    app_error("-x needs at least two threads (-j 2)");
+	eval_mt(tracefiles, num_tracefiles, nthreads, cross, run_libc);
+	exit(0);
+    }
+
+    /* Likewise the engine and page size comparisons */
+    if (allengines) {
+	eval_engines(tracedir, tracefiles, num_tracefiles);
+	exit(0);
+    }
+    if (sweep) {
+	eval_sweep(tracedir, tracefiles, num_tracefiles, sweep);
+	exit(0);
+    }
+    if (pagecompare) {
+	/* mm keeps its NUMA arenas across mm_init, on the first backing */
+	if (numa)
+	    app_error("-T can't be combined with -N");
+	eval_pages(tracedir, tracefiles, num_tracefiles);
+	exit(0);
+    }
+    if (sharethreads) {
+	eval_share(sharethreads);
+	exit(0);
+    }
+    if (cachethreads) {
+	exit(eval_cache(cachethreads, heapcheck) ? 1 : 0);
+    }
+    if (kernelcompare) {
+	eval_kernels(tracedir, tracefiles, num_tracefiles);
+	exit(0);
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package 
      */
@@ -261,7 +678,14 @@ int main(int argc, char **argv)
 		speed_params.trace = trace;
 		if (verbose > 1)
 		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		time_trace(eval_libc_speed, &speed_params, runs, &libc_stats[i]);
+		if (latency) {
+		    if ((libc_stats[i].lat = (lat_t *)malloc(sizeof(lat_t))) == NULL)
+			unix_error("lat malloc in main failed");
+		    eval_lat(trace, 1, libc_stats[i].lat);
+		}
+		if (hwcount)
+		    libc_stats[i].hw = eval_hw(eval_libc_speed, &speed_params);
 	    }
 	    free_trace(trace);
 	}
@@ -271,6 +695,14 @@ int main(int argc, char **argv)
 	    printf("\nResults for libc malloc:\n");
 	    printresults(num_tracefiles, libc_stats);
 	}
+	if (latency) {
+	    printf("\nLatency for libc malloc (ns):\n");
+	    printlatency(num_tracefiles, tracefiles, libc_stats);
+	}
+	if (hwcount) {
+	    printf("\nHardware counters for libc malloc:\n");
+	    printcounters(num_tracefiles, libc_stats);
+	}
     }
 
     /*
@@ -286,6 +718,8 @@ int main(int argc, char **argv)
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
+    if (verbose > 1)
+	printf("Heap on %s pages\n", mem_pages_name(mem_pages()));
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
@@ -293,19 +727,34 @@ int main(int argc, char **argv)
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges, heapcheck);
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
 	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].heapsize = mem_total_heapsize();
+	    mm_stats[i].sbrks = mem_sbrk_calls();
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    time_trace(eval_mm_speed, &speed_params, runs, &mm_stats[i]);
+	    if (latency) {
+		if ((mm_stats[i].lat = (lat_t *)malloc(sizeof(lat_t))) == NULL)
+		    unix_error("lat malloc in main failed");
+		eval_lat(trace, 0, mm_stats[i].lat);
+	    }
+	    if (hwcount)
+		mm_stats[i].hw = eval_hw(eval_mm_speed, &speed_params);
+	    if (fraginterval)
+		eval_frag(trace, i, fraginterval);
+	    if (profrate)
+		eval_prof(trace, i, profrate);
 	}
 	free_trace(trace);
     }
+    if (verbose > 1)
+	printf("mm has %d NUMA arena(s)\n", mm_numa_nodes());
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -313,6 +762,17 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (latency) {
+	printf("Latency for mm malloc (ns):\n");
+	printlatency(num_tracefiles, tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (hwcount) {
+	printf("Hardware counters for mm malloc:\n");
+	printcounters(num_tracefiles, mm_stats);
+	printf("\n");
+	perf_deinit();
+    }
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -362,6 +822,18 @@ int main(int argc, char **argv)
 	printf("perfidx:%.0f\n", perfindex);
     }
 
+    if (outspec)
+	writeresults(outspec, num_tracefiles, tracefiles, 
+		     libc_stats, mm_stats, perfindex);
+
+    /* Fail the run if it is significantly slower than the baseline */
+    if (baseline) {
+	regressions = compare_baseline(baseline, num_tracefiles, 
+				       tracefiles, mm_stats);
+	if (regressions > 0)
+	    exit(2);
+    }
+
     exit(0);
 }
 
@@ -395,9 +867,8 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of one of the heaps */
+    if (!mem_heap_contains(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -572,9 +1043,11 @@ void free_trace(trace_t *trace)
  **********************************************************************/
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * eval_mm_valid - Check the mm malloc package for correctness. With
+ *    heapcheck, also run mm_check after every request.
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges,
+			 int heapcheck) 
 {
     int i, j;
     int index;
@@ -593,6 +1066,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	malloc_error(tracenum, 0, "mm_init failed.");
 	return 0;
     }
+    reset_heaps();
 
     /* Interpret each operation in the trace in order */
     for (i = 0;  i < trace->num_ops;  i++) {
@@ -604,7 +1078,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         case ALLOC: /* mm_malloc */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    if ((p = trace_malloc(index, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
@@ -678,6 +1152,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	if (heapcheck && mm_check(1) != 0) {
+	    malloc_error(tracenum, i, "mm_check found an inconsistent heap.");
+	    return 0;
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -709,6 +1187,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     mem_reset_brk();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
+    reset_heaps();
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
@@ -717,7 +1196,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = trace_malloc(index, size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -774,7 +1253,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_total_heapsize());
 }
 
 
@@ -792,6 +1271,7 @@ static void eval_mm_speed(void *ptr)
     mem_reset_brk();
     if (mm_init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
+    reset_heaps();
 
     /* Interpret each trace request */
     for (i = 0;  i < trace->num_ops;  i++)
@@ -800,7 +1280,7 @@ static void eval_mm_speed(void *ptr)
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = trace_malloc(index, size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -825,6 +1305,54 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * reset_heaps - With -M, empty the extra heaps as mm_init has just
+ *    emptied the main one. They are created at the first call and then
+ *    only reset, so a timed run pays no mmap or munmap for them.
+ */
+static void reset_heaps(void)
+{
+    int i;
+
+    for (i = 1; i < nheaps; i++) {
+	if (heaps[i] == NULL) {
+	    if ((heaps[i] = mm_heap_create()) == NULL)
+		app_error("mm_heap_create failed");
+	}
+	else if (mm_heap_reset(heaps[i]) < 0)
+	    app_error("mm_heap_reset failed");
+    }
+}
+
+/*
+ * drop_heaps - With -M, destroy the extra heaps, so that the next
+ *    reset_heaps creates them afresh on the current memlib backing
+ */
+static void drop_heaps(void)
+{
+    int i;
+
+    for (i = 1; i < nheaps; i++) {
+	if (heaps[i] != NULL) {
+	    mm_heap_destroy(heaps[i]);
+	    heaps[i] = NULL;
+	}
+    }
+}
+
+/*
+ * trace_malloc - mm_malloc, or with -M mm_heap_malloc from the heap
+ *    that the block's id picks, or for -K mm_calloc
+ */
+static void *trace_malloc(int index, int size)
+{
+    if (nheaps > 1)
+	return mm_heap_malloc(heaps[index % nheaps], size);
+    if (use_calloc)
+	return mm_calloc(1, size);
+    return mm_malloc(size);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -910,6 +1438,1646 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/**********************************************************************
+ * The following functions repeat the timings, write the results in a
+ * machine-readable form, and compare them against a saved baseline.
+ **********************************************************************/
+
+/*
+ * time_trace - Time f with fsecs. With one run, use the spread of the
+ *    individual runs fsecs timed itself (USE_CLOCK); with -r, fsecs is
+ *    called runs times. Either way secs is the mean, which is what
+ *    compare_baseline's t-test needs, and the median is kept apart.
+ */
+static void time_trace(fsecs_test_funct f, speed_t *params, int runs, 
+		       stats_t *stats)
+{
+    int r;
+    double x, delta, mean = 0, m2 = 0;
+    double *samples;
+    fsecs_spread_t sp;
+
+    if (runs == 1) {
+	x = fsecs(f, params);
+	if (fsecs_spread(&sp)) {
+	    stats->runs = sp.runs;
+	    stats->secs = sp.mean;
+	    stats->secs_min = sp.min;
+	    stats->secs_median = sp.median;
+	    stats->secs_sd = sp.sd;
+	}
+	else {
+	    stats->runs = 1;
+	    stats->secs = stats->secs_min = stats->secs_median = x;
+	    stats->secs_sd = 0.0;
+	}
+	return;
+    }
+
+    if ((samples = (double *)malloc(runs * sizeof(double))) == NULL)
+	unix_error("samples malloc in time_trace failed");
+    for (r = 1; r <= runs; r++) {
+	x = samples[r-1] = fsecs(f, params);
+	/* Welford's running mean and sum of squared deviations */
+	delta = x - mean;
+	mean += delta / r;
+	m2 += delta * (x - mean);
+    }
+    qsort(samples, runs, sizeof(double), ftimer_dbl_cmp);
+    stats->runs = runs;
+    stats->secs = mean;
+    stats->secs_min = samples[0];
+    stats->secs_median = (runs % 2) ? samples[runs/2] : 
+	(samples[runs/2 - 1] + samples[runs/2]) / 2;
+    stats->secs_sd = sqrt(m2 / (runs - 1));
+    free(samples);
+}
+
+/*
+ * writeresults - Write per-trace results as JSON or CSV. spec is
+ *    "json" or "csv", optionally followed by ":<file>" (default stdout).
+ */
+static void writeresults(char *spec, int n, char **tracefiles, 
+			 stats_t *libc_stats, stats_t *mm_stats, 
+			 double perfindex)
+{
+    FILE *fp = stdout;
+    char *filename = strchr(spec, ':');
+    int json = !strncmp(spec, "json", 4);
+    int i, first = 1;
+
+    if (filename != NULL && (fp = fopen(filename + 1, "w")) == NULL) {
+	sprintf(msg, "Could not open %s in writeresults", filename + 1);
+	unix_error(msg);
+    }
+
+    if (json)
+	fprintf(fp, "{\n  \"perfindex\": %.1f,\n  \"errors\": %d,\n"
+		"  \"traces\": [", perfindex, errors);
+    else
+	fprintf(fp, "allocator,trace,valid,util,ops,secs,secs_min,"
+		"secs_median,secs_sd,"
+		"runs,kops,heap_hwm,sbrk_calls,lat_p50,lat_p90,lat_p99,lat_p999,"
+		"lat_max\n");
+
+    for (i = 0; i < n; i++) {
+	if (libc_stats) {
+	    if (json)
+		fprintf(fp, first ? "\n" : ",\n");
+	    writestats(fp, json, "libc", tracefiles[i], &libc_stats[i]);
+	    first = 0;
+	}
+	if (json)
+	    fprintf(fp, first ? "\n" : ",\n");
+	writestats(fp, json, "mm", tracefiles[i], &mm_stats[i]);
+	first = 0;
+    }
+
+    if (json)
+	fprintf(fp, "\n  ]\n}\n");
+    if (fp != stdout)
+	fclose(fp);
+}
+
+/*
+ * writestats - Write one JSON object or CSV row for one trace. Fields
+ *    that were not measured are null in JSON and empty in CSV.
+ */
+static void writestats(FILE *fp, int json, char *name, char *tracefile, 
+		       stats_t *stats)
+{
+    double pct[5];
+    int j;
+
+    if (stats->lat) {
+	pct[0] = hist_percentile(&stats->lat->all, 50.0);
+	pct[1] = hist_percentile(&stats->lat->all, 90.0);
+	pct[2] = hist_percentile(&stats->lat->all, 99.0);
+	pct[3] = hist_percentile(&stats->lat->all, 99.9);
+	pct[4] = stats->lat->all.max;
+    }
+
+    if (json) {
+	fprintf(fp, "    {\"allocator\": \"%s\", \"trace\": \"%s\", "
+		"\"valid\": %s", name, tracefile, 
+		stats->valid ? "true" : "false");
+	if (stats->valid) {
+	    fprintf(fp, ", \"util\": %.6f, \"ops\": %.0f, \"secs\": %.9f, "
+		    "\"secs_min\": %.9f, \"secs_median\": %.9f, "
+		    "\"secs_sd\": %.9f, \"runs\": %d, "
+		    "\"kops\": %.1f, \"heap_hwm\": %lu, \"sbrk_calls\": %d", 
+		    stats->util, stats->ops, stats->secs, stats->secs_min, 
+		    stats->secs_median, stats->secs_sd, stats->runs, 
+		    (stats->ops/1e3)/stats->secs, 
+		    (unsigned long)stats->heapsize, stats->sbrks);
+	    if (stats->lat)
+		fprintf(fp, ", \"latency_ns\": {\"p50\": %.0f, \"p90\": %.0f, "
+			"\"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f}",
+			pct[0], pct[1], pct[2], pct[3], pct[4]);
+	    else
+		fprintf(fp, ", \"latency_ns\": null");
+	}
+	fprintf(fp, "}");
+	return;
+    }
+
+    fprintf(fp, "%s,%s,%d", name, tracefile, stats->valid);
+    if (stats->valid) {
+	fprintf(fp, ",%.6f,%.0f,%.9f,%.9f,%.9f,%.9f,%d,%.1f,%lu,%d", 
+		stats->util, stats->ops, stats->secs, stats->secs_min,
+		stats->secs_median, stats->secs_sd, stats->runs, (stats->ops/1e3)/stats->secs, 
+		(unsigned long)stats->heapsize, stats->sbrks);
+	for (j = 0; j < 5; j++) {
+	    if (stats->lat)
+		fprintf(fp, ",%.0f", pct[j]);
+	    else
+		fprintf(fp, ",");
+	}
+    }
+    else
+	fprintf(fp, ",,,,,,,,,,,,,,,");
+    fprintf(fp, "\n");
+}
+
+/*
+ * compare_baseline - Compare the mm results against the mm rows of a
+ *    CSV file written earlier with -o csv. The mean times are compared
+ *    with Welch's t-test at the 95% level, so both sides need at least
+ *    two runs for a verdict (-r, or a timer that measures each run). Returns the number of traces that got
+ *    significantly slower.
+ */
+static int compare_baseline(char *filename, int n, char **tracefiles, 
+			    stats_t *stats)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    char *field, *save;
+    char *cols[32];
+    int ncols, i, k, found;
+    int c_alloc = -1, c_trace = -1, c_util = -1, c_secs = -1;
+    int c_sd = -1, c_runs = -1;
+    int regressions = 0;
+    double bsecs, bsd, butil, bruns, se, t, df, va, vb, change;
+    char *verdict;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in compare_baseline", filename);
+	unix_error(msg);
+    }
+
+    /* Locate the columns we need from the header line */
+    if (fgets(line, MAXLINE, fp) == NULL)
+	app_error("Empty baseline file");
+    line[strcspn(line, "\r\n")] = '\0';
+    for (k = 0, field = strtok_r(line, ",", &save); field != NULL; 
+	 k++, field = strtok_r(NULL, ",", &save)) {
+	if (!strcmp(field, "allocator")) c_alloc = k;
+	else if (!strcmp(field, "trace")) c_trace = k;
+	else if (!strcmp(field, "util")) c_util = k;
+	else if (!strcmp(field, "secs")) c_secs = k;
+	else if (!strcmp(field, "secs_sd")) c_sd = k;
+	else if (!strcmp(field, "runs")) c_runs = k;
+    }
+    if (c_alloc < 0 || c_trace < 0 || c_util < 0 || c_secs < 0 || 
+	c_sd < 0 || c_runs < 0)
+	app_error("Baseline file is not in mdriver -o csv format");
+
+    printf("\nComparison with baseline %s (mm malloc):\n", filename);
+    printf("%5s%8s%8s%10s%10s%8s%8s  %s\n", "trace", "util", "base",
+	   "Kops", "base", "change", "t", "verdict");
+
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+
+	/* Find the matching mm row in the baseline */
+	found = 0;
+	rewind(fp);
+	fgets(line, MAXLINE, fp);
+	while (!found && fgets(line, MAXLINE, fp) != NULL) {
+	    line[strcspn(line, "\r\n")] = '\0';
+	    /* split on every comma, keeping empty fields */
+	    for (ncols = 0, field = line; ncols < 32; ncols++) {
+		cols[ncols] = field;
+		if ((field = strchr(field, ',')) == NULL) {
+		    ncols++;
+		    break;
+		}
+		*field++ = '\0';
+	    }
+	    if (ncols > c_runs && ncols > c_sd && ncols > c_secs && 
+		!strcmp(cols[c_alloc], "mm") && 
+		!strcmp(cols[c_trace], tracefiles[i]) && *cols[c_secs])
+		found = 1;
+	}
+	if (!found) {
+	    printf("%2d%54s  %s\n", i, "", "not in baseline");
+	    continue;
+	}
+	butil = atof(cols[c_util]);
+	bsecs = atof(cols[c_secs]);
+	bsd = atof(cols[c_sd]);
+	bruns = atof(cols[c_runs]);
+
+	/* Throughput change, positive means faster than the baseline */
+	change = (bsecs / stats[i].secs - 1.0) * 100.0;
+
+	/* Welch's t statistic and Welch-Satterthwaite degrees of freedom */
+	t = 0;
+	if (stats[i].runs < 2 || bruns < 2)
+	    verdict = "n/a (need >= 2 runs)";
+	else {
+	    va = stats[i].secs_sd * stats[i].secs_sd / stats[i].runs;
+	    vb = bsd * bsd / bruns;
+	    se = sqrt(va + vb);
+	    if (se > 0) {
+		t = (stats[i].secs - bsecs) / se;
+		df = (va + vb) * (va + vb) / 
+		    (va * va / (stats[i].runs - 1) + vb * vb / (bruns - 1));
+	    }
+	    else {
+		t = (stats[i].secs == bsecs) ? 0 : 
+		    (stats[i].secs > bsecs ? HUGE_VAL : -HUGE_VAL);
+		df = stats[i].runs + bruns - 2;
+	    }
+	    if (fabs(t) < t_critical(df))
+		verdict = "no significant change";
+	    else if (t > 0) {
+		verdict = "REGRESSION";
+		regressions++;
+	    }
+	    else
+		verdict = "improvement";
+	}
+	printf("%2d%10.0f%%%7.0f%%%10.0f%10.0f%7.1f%%%8.2f  %s\n", i, 
+	       stats[i].util*100.0, butil*100.0,
+	       (stats[i].ops/1e3)/stats[i].secs, (stats[i].ops/1e3)/bsecs,
+	       change, t, verdict);
+    }
+    fclose(fp);
+
+    printf("%d significant regression%s\n", regressions, 
+	   regressions == 1 ? "" : "s");
+    return regressions;
+}
+
+/*
+ * t_critical - Two-sided 95% critical value of Student's t distribution
+ */
+static double t_critical(double df)
+{
+    static double table[] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    int k = (int)df;
+
+    if (k < 1)
+	k = 1;
+    return (k <= 30) ? table[k-1] : 1.96;
+}
+
+/**********************************************************************
+ * The following functions replay a trace once more with every request
+ * timestamped individually, to get latency distributions (-L) rather
+ * than the average that fsecs reports.
+ **********************************************************************/
+
+/*
+ * eval_lat - Replay the trace against libc or mm, recording the latency
+ *    of every request into the histogram for its type and size class.
+ *    Frees are classified by the payload size of the block they release.
+ *    The libc blocks still live at the end are freed, untimed; mm's go
+ *    with the next mm_init.
+ */
+static void eval_lat(trace_t *trace, int libc, lat_t *lat)
+{
+    int i, index, size;
+    uint64_t t0, dt;
+    char *p;
+
+    memset(lat, 0, sizeof(lat_t));
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+    if (!libc) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_lat");
+	reset_heaps();
+    }
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+	    t0 = hist_now();
+	    p = libc ? malloc(size) : trace_malloc(index, size);
+	    dt = hist_now() - t0;
+	    if (p == NULL)
+		app_error("malloc failed in eval_lat");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+	case REALLOC: /* realloc */
+	    t0 = hist_now();
+	    p = libc ? realloc(trace->blocks[index], size)
+		     : mm_realloc(trace->blocks[index], size);
+	    dt = hist_now() - t0;
+	    if (p == NULL)
+		app_error("realloc failed in eval_lat");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+        case FREE: /* free */
+	    size = trace->block_sizes[index];
+	    p = trace->blocks[index];
+	    t0 = hist_now();
+	    if (libc)
+		free(p);
+	    else
+		mm_free(p);
+	    dt = hist_now() - t0;
+	    trace->blocks[index] = NULL;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_lat");
+	    return;
+	}
+
+	hist_record(&lat->op[trace->ops[i].type][lat_class(size)], dt);
+	hist_record(&lat->all, dt);
+    }
+
+    if (libc)
+	for (i = 0; i < trace->num_ids; i++)
+	    if (trace->blocks[i] != NULL)
+		free(trace->blocks[i]);
+}
+
+/*
+ * lat_class - Size class used to split the latency histograms
+ */
+static int lat_class(int size)
+{
+    if (size <= 64)
+	return 0;
+    if (size <= 512)
+	return 1;
+    if (size <= 4096)
+	return 2;
+    return 3;
+}
+
+/*
+ * printlatency - Print p50/p90/p99/p999/max per op type and size class
+ *    for every trace, followed by the row for all requests combined.
+ */
+static void printlatency(int n, char **tracefiles, stats_t *stats)
+{
+    static char *opnames[] = {"malloc", "free", "realloc"};
+    static char *classnames[] = {"<=64", "<=512", "<=4096", ">4096"};
+    int i, t, c;
+    hist_t *h;
+
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid || stats[i].lat == NULL)
+	    continue;
+	printf("%2d %s\n", i, tracefiles[i]);
+	printf("   %-8s%7s%8s%7s%7s%7s%7s%9s\n", 
+	       "op", "size", "count", "p50", "p90", "p99", "p999", "max");
+	for (t = 0; t < 3; t++) {
+	    for (c = 0; c < LAT_NCLASS; c++) {
+		h = &stats[i].lat->op[t][c];
+		if (h->total == 0)
+		    continue;
+		printf("   %-8s%7s%8llu%7llu%7llu%7llu%7llu%9llu\n",
+		       opnames[t], classnames[c],
+		       (unsigned long long)h->total,
+		       (unsigned long long)hist_percentile(h, 50.0),
+		       (unsigned long long)hist_percentile(h, 90.0),
+		       (unsigned long long)hist_percentile(h, 99.0),
+		       (unsigned long long)hist_percentile(h, 99.9),
+		       (unsigned long long)h->max);
+	    }
+	}
+	h = &stats[i].lat->all;
+	printf("   %-8s%7s%8llu%7llu%7llu%7llu%7llu%9llu\n",
+	       "all", "",
+	       (unsigned long long)h->total,
+	       (unsigned long long)hist_percentile(h, 50.0),
+	       (unsigned long long)hist_percentile(h, 90.0),
+	       (unsigned long long)hist_percentile(h, 99.0),
+	       (unsigned long long)hist_percentile(h, 99.9),
+	       (unsigned long long)h->max);
+    }
+}
+
+/**********************************************************************
+ * The following functions replay a trace once more and, every few
+ * requests, walk the heap through mm_heap_walk to explain where the
+ * utilization goes (-F): boundary tags and padding inside allocated
+ * blocks, and free space that is too scattered to be useful.
+ **********************************************************************/
+
+/*
+ * eval_frag - Replay the trace against mm, sampling the heap shape every
+ *    interval requests and once at the end. Print the utilization curve,
+ *    then the free-block histogram and free-list lengths at the sample
+ *    with the most live bytes.
+ */
+static void eval_frag(trace_t *trace, int tracenum, int interval)
+{
+    int i, b, index, size;
+    frag_t f, peak;
+    struct mm_stats st;
+    char *p;
+
+    memset(&peak, 0, sizeof(frag_t));
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_frag");
+    reset_heaps();
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+
+    printf("\nHeap shape for trace %d (every %d requests):\n", 
+	   tracenum, interval);
+    printfrag(NULL, 1);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = trace_malloc(index, size)) == NULL)
+		app_error("mm_malloc failed in eval_frag");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+		app_error("mm_realloc failed in eval_frag");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+        case FREE: /* mm_free */
+	    mm_free(trace->blocks[index]);
+	    trace->blocks[index] = NULL;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_frag");
+        }
+
+	if ((i + 1) % interval == 0 || i == trace->num_ops - 1) {
+	    frag_sample(trace, i + 1, &f);
+	    printfrag(&f, 0);
+	    if (f.live >= peak.live)
+		peak = f;
+	}
+    }
+
+    printf("Free blocks at peak live bytes (request %d):\n", peak.op);
+    for (b = 0; b < FRAG_NBINS; b++) {
+	if (peak.bins[b] == 0)
+	    continue;
+	if (b < FRAG_NBINS - 1)
+	    printf("  [%7d, %7d) %6d\n", 1 << (b + 4), 1 << (b + 5), 
+		   peak.bins[b]);
+	else
+	    printf("  [%7d,     inf) %6d\n", 1 << (b + 4), peak.bins[b]);
+    }
+    printf("Free list lengths:");
+    for (b = 0; b < peak.nlists && b < FRAG_NLISTS; b++)
+	printf(" %lu", (unsigned long)peak.lists[b]);
+    printf("\n");
+
+    /* Cross-check the walk against the allocator's own counters */
+    mm_stats(&st);
+    printf("mm_stats at end: heap %lu, allocated %lu, free %lu in %lu blocks "
+	   "(largest %lu), %lu/%lu/%lu malloc/free/realloc calls\n",
+	   (unsigned long)st.heap, (unsigned long)st.allocated, 
+	   (unsigned long)st.free, (unsigned long)st.free_blocks, 
+	   (unsigned long)st.largest_free, st.mallocs, st.frees, st.reallocs);
+}
+
+/*
+ * frag_sample - Walk the heap and fill in one sample
+ */
+static void frag_sample(trace_t *trace, int op, frag_t *f)
+{
+    liveblk_t *live;
+    fragwalk_t walk;
+    int i, n = 0;
+
+    memset(f, 0, sizeof(frag_t));
+    f->op = op;
+    f->heapsize = mem_total_heapsize();
+
+    /* Sort the live blocks by address so the walk can look them up */
+    if ((live = (liveblk_t *)malloc(trace->num_ids * 
+				    sizeof(liveblk_t))) == NULL)
+	unix_error("live malloc in frag_sample failed");
+    for (i = 0; i < trace->num_ids; i++) {
+	if (trace->blocks[i] != NULL) {
+	    live[n].p = trace->blocks[i];
+	    live[n].size = trace->block_sizes[i];
+	    f->live += live[n].size;
+	    n++;
+	}
+    }
+    qsort(live, n, sizeof(liveblk_t), liveblk_cmp);
+
+    walk.f = f;
+    walk.live = live;
+    walk.nlive = n;
+    mm_heap_walk(frag_visit, &walk);
+    f->nlists = mm_freelists(f->lists, FRAG_NLISTS);
+    free(live);
+}
+
+/*
+ * frag_visit - mm_heap_walk callback: account for one block
+ */
+static void frag_visit(const mm_block_t *blk, void *arg)
+{
+    fragwalk_t *walk = (fragwalk_t *)arg;
+    frag_t *f = walk->f;
+    liveblk_t key, *hit;
+    int b;
+
+    if (blk->allocated) {
+	key.p = blk->payload;
+	hit = (liveblk_t *)bsearch(&key, walk->live, walk->nlive, 
+				   sizeof(liveblk_t), liveblk_cmp);
+	f->tags += blk->overhead;
+	if (hit != NULL)
+	    f->rounding += blk->size - blk->overhead - hit->size;
+	return;
+    }
+
+    f->freebytes += blk->size;
+    f->nfree++;
+    if (blk->size > f->largest)
+	f->largest = blk->size;
+    for (b = 0; b < FRAG_NBINS - 1 && blk->size >= (1u << (b + 5)); b++)
+	;
+    f->bins[b]++;
+}
+
+/*
+ * printfrag - Print one row of the utilization curve (or the header)
+ */
+static void printfrag(frag_t *f, int header)
+{
+    if (header) {
+	printf("%8s%10s%10s%6s%7s%7s%10s%10s%7s%7s\n", "request", "heap", 
+	       "live", "util", "tags", "round", "free", "largest", 
+	       "extfrg", "nfree");
+	return;
+    }
+    printf("%8d%10lu%10lu%5.0f%%%6.1f%%%6.1f%%%10lu%10lu%6.1f%%%7d\n",
+	   f->op, (unsigned long)f->heapsize, (unsigned long)f->live,
+	   f->heapsize ? 100.0 * f->live / f->heapsize : 0.0,
+	   f->heapsize ? 100.0 * f->tags / f->heapsize : 0.0,
+	   f->heapsize ? 100.0 * f->rounding / f->heapsize : 0.0,
+	   (unsigned long)f->freebytes, (unsigned long)f->largest,
+	   f->freebytes ? 100.0 * (1.0 - (double)f->largest / f->freebytes) 
+	   : 0.0,
+	   f->nfree);
+}
+
+/* liveblk_cmp - Order live blocks by address */
+static int liveblk_cmp(const void *a, const void *b)
+{
+    char *x = ((const liveblk_t *)a)->p, *y = ((const liveblk_t *)b)->p;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_prof - Replay the trace with mm's sampling profiler on and dump
+ *     the profile to trace<n>.heap at the request where the live
+ *     payload peaks, which is found with a dry run over the sizes first.
+ */
+static void eval_prof(trace_t *trace, int tracenum, int rate)
+{
+    int i, index, size, peak = 0;
+    long live = 0, maxlive = -1;
+    char name[64];
+    FILE *fp;
+    char *p;
+
+    memset(trace->block_sizes, 0, trace->num_ids * sizeof(size_t));
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	if (trace->ops[i].type == FREE) {
+	    live -= trace->block_sizes[index];
+	    trace->block_sizes[index] = 0;
+	} else {
+	    live += trace->ops[i].size - (long)trace->block_sizes[index];
+	    trace->block_sizes[index] = trace->ops[i].size;
+	}
+	if (live > maxlive) {
+	    maxlive = live;
+	    peak = i;
+	}
+    }
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_prof");
+    reset_heaps();
+    mm_prof_rate(rate);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = trace_malloc(index, size)) == NULL)
+		app_error("mm_malloc failed in eval_prof");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+		app_error("mm_realloc failed in eval_prof");
+	    trace->blocks[index] = p;
+	    break;
+
+        case FREE: /* mm_free */
+	    mm_free(trace->blocks[index]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_prof");
+        }
+
+	if (i == peak) {
+	    sprintf(name, "trace%d.heap", tracenum);
+	    if ((fp = fopen(name, "w")) == NULL)
+		unix_error("eval_prof: can't create the profile");
+	    mm_prof_dump(fp);
+	    fclose(fp);
+	    printf("Sampled heap at request %d (%ld live bytes) written to %s\n",
+		   peak, maxlive, name);
+	}
+    }
+    mm_prof_rate(0);
+}
+
+/**********************************************************************
+ * The following function runs the traces against every engine mm was
+ * built with (fit, list order, coalescing and growth policies), for a
+ * side by side comparison in one binary.
+ **********************************************************************/
+
+/*
+ * eval_engines - Score each engine the way main scores mm: check, then
+ *     measure utilization and throughput of every trace.
+ */
+static void eval_engines(char *tracedir, char **tracefiles, int n)
+{
+    trace_t **traces;
+    const char *name;
+    int e, i;
+
+    if ((traces = (trace_t **)malloc(n * sizeof(trace_t *))) == NULL)
+	unix_error("malloc failed in eval_engines");
+    for (i = 0; i < n; i++)
+	traces[i] = read_trace(tracedir, tracefiles[i]);
+    mem_init();
+
+    printf("\n%-24s %5s %5s %9s %7s %6s %5s\n", "engine", "valid", "util", 
+	   "Kops", "heapK", "sbrk", "perf");
+    for (e = 0; (name = mm_engine_name(e)) != NULL; e++) {
+	mm_set_engine(name);
+	eval_row(name, traces, n);
+    }
+    mm_set_engine(mm_engine_name(0));
+
+    for (i = 0; i < n; i++)
+	free_trace(traces[i]);
+    free(traces);
+}
+
+/*
+ * eval_sweep - Score mm the same way with each value of a knob, from
+ *     an -O name=value:value:... (see mm_ctl in mm.h), then put the knob
+ *     back as it was.
+ */
+static void eval_sweep(char *tracedir, char **tracefiles, int n, char *opt)
+{
+    trace_t **traces;
+    char *eq, *val, *save, buf[MAXLINE];
+    size_t old;
+    int i;
+
+    if ((eq = strchr(opt, '=')) == NULL)
+	app_error("-O wants name=value:value:...");
+    *eq = '\0';
+    if (mm_ctl(opt, &old, NULL) < 0) {
+	fprintf(stderr, "Unknown knob %s in -O (see mm.h)\n", opt);
+	exit(1);
+    }
+    if ((traces = (trace_t **)malloc(n * sizeof(trace_t *))) == NULL)
+	unix_error("malloc failed in eval_sweep");
+    for (i = 0; i < n; i++)
+	traces[i] = read_trace(tracedir, tracefiles[i]);
+    mem_init();
+
+    printf("\n%-24s %5s %5s %9s %7s %6s %5s\n", opt, "valid", "util", 
+	   "Kops", "heapK", "sbrk", "perf");
+    for (val = strtok_r(eq + 1, ":", &save); val != NULL; val = strtok_r(NULL, ":", &save)) {
+	snprintf(buf, sizeof(buf), "%s=%s", opt, val);
+	if (mm_ctl_parse(buf) < 0) {
+	    printf("%-24s bad value\n", val);
+	    continue;
+	}
+	eval_row(val, traces, n);
+    }
+    mm_ctl(opt, NULL, &old);
+
+    for (i = 0; i < n; i++)
+	free_trace(traces[i]);
+    free(traces);
+}
+
+/*
+ * eval_row - One row of eval_engines' and eval_sweep's tables: check,
+ *     then measure utilization and throughput of every trace.
+ */
+static void eval_row(const char *label, trace_t **traces, int n)
+{
+    range_t *ranges = NULL;
+    speed_t params;
+    double secs, ops, util, thru, p1, p2;
+    int i, valid, sbrks;
+    size_t heap;
+
+    secs = ops = util = 0;
+    valid = sbrks = 0;
+    heap = 0;
+    for (i = 0; i < n; i++) {
+	if (!eval_mm_valid(traces[i], i, &ranges, 0))
+	    continue;
+	valid++;
+	util += eval_mm_util(traces[i], i, &ranges);
+	heap += mem_total_heapsize();
+	sbrks += mem_sbrk_calls();
+	params.trace = traces[i];
+	params.ranges = ranges;
+	secs += fsecs(eval_mm_speed, &params);
+	ops += traces[i]->num_ops;
+    }
+    util /= n;
+    thru = secs > 0 ? ops / secs : 0;
+    p1 = UTIL_WEIGHT * util;
+    p2 = (1.0 - UTIL_WEIGHT) * (thru > AVG_LIBC_THRUPUT ? 1.0 : 
+				thru / AVG_LIBC_THRUPUT);
+    printf("%-24s %2d/%-2d %4.0f%% %9.0f %7lu %6d %5.0f\n", label, valid, n, 
+	   util * 100.0, thru / 1e3, (unsigned long)heap / 1024, sbrks, 
+	   valid == n ? (p1 + p2) * 100.0 : 0.0);
+    fflush(stdout);
+    clear_ranges(&ranges);
+}
+
+/**********************************************************************
+ * The following function times mm with each of the copy and zero
+ * kernels of memops.c that the CPU supports, on the realloc traces
+ * (mm_realloc copies) and on the same traces allocating with mm_calloc
+ * (which zeroes), and then on bare copies of a few sizes.
+ **********************************************************************/
+
+#define KERNEL_SIZES 3
+
+/*
+ * eval_kernels - Throughput of the realloc traces among the given ones
+ *     (all of them if there are none) and copy bandwidth, per kernel.
+ */
+static void eval_kernels(char *tracedir, char **tracefiles, int n)
+{
+    static const size_t sizes[KERNEL_SIZES] = {4 << 10, 256 << 10, 8 << 20};
+    trace_t **traces;
+    range_t *ranges = NULL;
+    speed_t params;
+    const char *name;
+    char *src, *dst;
+    double secs, ops, start;
+    int i, k, t, nt = 0, reps;
+
+    if ((traces = (trace_t **)malloc(n * sizeof(trace_t *))) == NULL)
+	unix_error("malloc failed in eval_kernels");
+    for (i = 0; i < n; i++)
+	if (strstr(tracefiles[i], "realloc") != NULL)
+	    traces[nt++] = read_trace(tracedir, tracefiles[i]);
+    if (nt == 0)
+	for (i = 0; i < n; i++)
+	    traces[nt++] = read_trace(tracedir, tracefiles[i]);
+    mem_init();
+    for (t = 0; t < nt; t++)
+	if (!eval_mm_valid(traces[t], t, &ranges, 0))
+	    app_error("trace is not valid in eval_kernels");
+
+    printf("\n%-6s %12s %12s", "kernel", "realloc Kops", "calloc Kops");
+    for (k = 0; k < KERNEL_SIZES; k++)
+	printf("  copy %4luK", (unsigned long)(sizes[k] >> 10));
+    printf("\n");
+
+    if ((src = (char *)malloc(sizes[KERNEL_SIZES-1] + 8)) == NULL ||
+	(dst = (char *)malloc(sizes[KERNEL_SIZES-1] + 8)) == NULL)
+	unix_error("malloc failed in eval_kernels");
+    memset(src, 1, sizes[KERNEL_SIZES-1] + 8);
+    memset(dst, 0, sizes[KERNEL_SIZES-1] + 8);
+
+    for (i = 0; (name = memops_name(i)) != NULL; i++) {
+	if (memops_set(name) < 0) {
+	    printf("%-6s %12s\n", name, "unsupported");
+	    continue;
+	}
+	printf("%-6s", name);
+	for (use_calloc = 0; use_calloc <= 1; use_calloc++) {
+	    secs = ops = 0;
+	    for (t = 0; t < nt; t++) {
+		params.trace = traces[t];
+		params.ranges = ranges;
+		secs += fsecs(eval_mm_speed, &params);
+		ops += traces[t]->num_ops;
+	    }
+	    printf(" %12.0f", ops / 1e3 / secs);
+	}
+	use_calloc = 0;
+
+	/* Payloads are only 8-byte aligned, so copy between such addresses */
+	for (k = 0; k < KERNEL_SIZES; k++) {
+	    reps = (int)((64 << 20) / sizes[k]);
+	    start = mt_now();
+	    for (t = 0; t < reps; t++)
+		memops_copy(dst + 8, src + 8, sizes[k]);
+	    secs = mt_now() - start;
+	    printf("  %6.1f GB/s", (double)reps * sizes[k] / 1e9 / secs);
+	}
+	printf("\n");
+	fflush(stdout);
+    }
+    memops_set(NULL);
+
+    free(src);
+    free(dst);
+    for (t = 0; t < nt; t++)
+	free_trace(traces[t]);
+    free(traces);
+}
+
+/**********************************************************************
+ * The following function replays the traces on a heap backed by 4K
+ * pages, transparent huge pages and hugetlbfs pages in turn, to see
+ * what the TLB costs the free list and coalescing walks.
+ **********************************************************************/
+
+/*
+ * eval_pages - Time every trace and count its dTLB misses (when the
+ *     counter is available) on each kind of page. With -M the extra
+ *     heaps are made again for each kind, as they keep the backing
+ *     they were made with.
+ */
+static void eval_pages(char *tracedir, char **tracefiles, int n)
+{
+    static const int kinds[] = {MEM_PAGES_4K, MEM_PAGES_THP, MEM_PAGES_HUGETLB};
+    const int nkinds = sizeof(kinds) / sizeof(kinds[0]);
+    trace_t **traces;
+    range_t *ranges = NULL;
+    speed_t params;
+    perf_counts_t hw;
+    double secs[3], miss[3], ops = 0, s, m;
+    int got[3], i, k, counters;
+
+    if ((traces = (trace_t **)malloc(n * sizeof(trace_t *))) == NULL)
+	unix_error("malloc failed in eval_pages");
+    for (i = 0; i < n; i++) {
+	traces[i] = read_trace(tracedir, tracefiles[i]);
+	ops += traces[i]->num_ops;
+    }
+    if ((counters = perf_init()) == 0)
+	printf("Hardware counters unavailable, reporting throughput only\n");
+
+    printf("\n%5s", "trace");
+    for (k = 0; k < nkinds; k++)
+	printf("%10s Kops %9s", mem_pages_name(kinds[k]), "dTLB/op");
+    printf("\n");
+
+    for (k = 0; k < nkinds; k++) 
+	secs[k] = miss[k] = 0;
+    for (i = 0; i < n; i++) {
+	printf("%5d", i);
+	for (k = 0; k < nkinds; k++) {
+	    mem_set_pages(kinds[k]);
+	    mem_init();
+	    got[k] = mem_pages();
+	    if (!eval_mm_valid(traces[i], i, &ranges, 0))
+		app_error("trace is not valid in eval_pages");
+	    params.trace = traces[i];
+	    params.ranges = ranges;
+	    s = fsecs(eval_mm_speed, &params);
+	    hw.valid[PERF_DTLB_MISSES] = 0;
+	    if (counters) {
+		perf_start();
+		eval_mm_speed(&params);
+		perf_stop(&hw);
+	    }
+	    secs[k] += s;
+	    printf("%15.0f", (traces[i]->num_ops / 1e3) / s);
+	    if (hw.valid[PERF_DTLB_MISSES]) {
+		m = (double)hw.count[PERF_DTLB_MISSES];
+		miss[k] += m;
+		printf("%10.4f", m / traces[i]->num_ops);
+	    }
+	    else
+		printf("%10s", "-");
+	    drop_heaps();
+	    mem_deinit();
+	}
+	printf("\n");
+    }
+
+    printf("Total");
+    for (k = 0; k < nkinds; k++) {
+	printf("%15.0f", (ops / 1e3) / secs[k]);
+	if (counters)
+	    printf("%10.4f", miss[k] / ops);
+	else
+	    printf("%10s", "-");
+    }
+    printf("\n");
+    for (k = 0; k < nkinds; k++)
+	if (got[k] != kinds[k])
+	    printf("(%s was not available, that column ran on %s pages)\n",
+		   mem_pages_name(kinds[k]), mem_pages_name(got[k]));
+
+    if (counters)
+	perf_deinit();
+    mem_set_pages(MEM_PAGES_4K);
+    for (i = 0; i < n; i++)
+	free_trace(traces[i]);
+    free(traces);
+}
+
+/**********************************************************************
+ * The following functions replay a trace once more under the hardware
+ * performance counters (-P), to tell cache and TLB misses apart from
+ * branch mispredicts when throughput changes.
+ **********************************************************************/
+
+/*
+ * eval_hw - Run one xxx_speed replay with the counters enabled
+ */
+static perf_counts_t *eval_hw(fsecs_test_funct f, speed_t *params)
+{
+    perf_counts_t *hw;
+
+    if ((hw = (perf_counts_t *)malloc(sizeof(perf_counts_t))) == NULL)
+	unix_error("hw malloc in eval_hw failed");
+    perf_start();
+    f(params);
+    perf_stop(hw);
+    return hw;
+}
+
+/*
+ * printcounters - Print the counters per op for each trace and over all
+ *    traces, followed by the raw per-trace totals.
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    int i, e;
+    double ops = 0;
+    double total[PERF_NEVENTS];
+    int valid[PERF_NEVENTS];
+
+    for (e = 0; e < PERF_NEVENTS; e++) {
+	total[e] = 0;
+	valid[e] = 1;
+    }
+
+    printf("%5s", "trace");
+    for (e = 0; e < PERF_NEVENTS; e++)
+	printf("%10s", perf_name(e));
+    printf("   (per op)\n");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid || stats[i].hw == NULL)
+	    continue;
+	printf("%2d   ", i);
+	for (e = 0; e < PERF_NEVENTS; e++) {
+	    if (stats[i].hw->valid[e]) {
+		printf("%10.2f", stats[i].hw->count[e] / stats[i].ops);
+		total[e] += stats[i].hw->count[e];
+	    }
+	    else {
+		printf("%10s", "-");
+		valid[e] = 0;
+	    }
+	}
+	printf("\n");
+	ops += stats[i].ops;
+    }
+    printf("%-5s", "Total");
+    for (e = 0; e < PERF_NEVENTS; e++) {
+	if (valid[e] && ops > 0)
+	    printf("%10.2f", total[e] / ops);
+	else
+	    printf("%10s", "-");
+    }
+    printf("\n");
+
+    printf("%5s", "trace");
+    for (e = 0; e < PERF_NEVENTS; e++)
+	printf("%10s", perf_name(e));
+    printf("   (per trace)\n");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid || stats[i].hw == NULL)
+	    continue;
+	printf("%2d   ", i);
+	for (e = 0; e < PERF_NEVENTS; e++) {
+	    if (stats[i].hw->valid[e])
+		printf("%10llu", (unsigned long long)stats[i].hw->count[e]);
+	    else
+		printf("%10s", "-");
+	}
+	printf("\n");
+    }
+}
+
+/**********************************************************************
+ * The following functions replay traces from several threads at once
+ * (-j). Each thread replays its own copy of a trace with a private
+ * block array, so the id spaces never collide. In cross-thread mode
+ * (-x) every free is handed to the next thread, which performs it.
+ **********************************************************************/
+
+/*
+ * eval_mt - Replay N traces (or N copies of the single -f trace)
+ *    concurrently, first against libc (if -l) and then against mm,
+ *    and print per-thread and aggregate throughput.
+ */
+static void eval_mt(char **tracefiles, int num_tracefiles, int nthreads,
+		    int cross, int run_libc)
+{
+    int i, pass;
+    double wall, ops;
+    trace_t **traces;
+    mtarg_t *args;
+
+    if ((traces = (trace_t **)calloc(nthreads, sizeof(trace_t *))) == NULL)
+	unix_error("traces calloc in eval_mt failed");
+    if ((args = (mtarg_t *)calloc(nthreads, sizeof(mtarg_t))) == NULL)
+	unix_error("args calloc in eval_mt failed");
+
+    /* Thread i replays trace i mod num_tracefiles */
+    for (i = 0; i < nthreads; i++)
+	traces[i] = read_trace(tracedir, tracefiles[i % num_tracefiles]);
+
+    printf("Replaying on %d threads%s\n", nthreads,
+	   cross ? " with cross-thread frees" : "");
+
+    for (pass = run_libc ? 0 : 1; pass < 2; pass++) {
+	if (pass == 1) {
+#ifndef MM_THREADSAFE
+	    printf("\nSkipping mm malloc: mm.c was not built thread-safe "
+		   "(rebuild with make THREADSAFE=1)\n");
+	    break;
+#else
+	    mem_init();
+	    mem_reset_brk();
+	    if (mm_init() < 0)
+		app_error("mm_init failed in eval_mt");
+	    if (verbose > 1)
+		printf("mm has %d NUMA arena(s)\n", mm_numa_nodes());
+#endif
+	}
+
+	wall = mt_run(traces, nthreads, cross, pass == 0, args);
+
+	printf("\nResults for %s malloc:\n", pass == 0 ? "libc" : "mm");
+	printf("%6s %-20s%8s%10s%8s\n", 
+	       "thread", "trace", "ops", "secs", "Mops");
+	ops = 0;
+	for (i = 0; i < nthreads; i++) {
+	    printf("%6d %-20s%8d%10.6f%8.2f\n",
+		   i,
+		   tracefiles[i % num_tracefiles],
+		   traces[i]->num_ops,
+		   args[i].t1 - args[i].t0,
+		   (traces[i]->num_ops/1e6)/(args[i].t1 - args[i].t0));
+	    ops += traces[i]->num_ops;
+	}
+	printf("%6s %-20s%8.0f%10.6f%8.2f\n", 
+	       "Total", "(wall clock)", ops, wall, (ops/1e6)/wall);
+    }
+
+    for (i = 0; i < nthreads; i++)
+	free_trace(traces[i]);
+    free(traces);
+    free(args);
+}
+
+/*
+ * mt_run - Start one replay thread per trace, wait for all of them, and
+ *    return the wall-clock time from the first start to the last finish.
+ */
+static double mt_run(trace_t **traces, int nthreads, int cross, int libc,
+		     mtarg_t *args)
+{
+    int i;
+    double t0, t1;
+    pthread_t *tids;
+    mailbox_t *boxes;
+    pthread_barrier_t start, done;
+
+    if ((tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) == NULL)
+	unix_error("tids calloc in mt_run failed");
+    if ((boxes = (mailbox_t *)calloc(nthreads, sizeof(mailbox_t))) == NULL)
+	unix_error("boxes calloc in mt_run failed");
+    pthread_barrier_init(&start, NULL, nthreads);
+    pthread_barrier_init(&done, NULL, nthreads);
+
+    for (i = 0; i < nthreads; i++) {
+	pthread_mutex_init(&boxes[i].lock, NULL);
+	memset(&args[i], 0, sizeof(mtarg_t));
+	args[i].trace = traces[i];
+	if ((args[i].blocks = 
+	     (char **)calloc(traces[i]->num_ids, sizeof(char *))) == NULL)
+	    unix_error("blocks calloc in mt_run failed");
+	args[i].libc = libc;
+	args[i].tid = i;
+	args[i].nthreads = nthreads;
+	args[i].cross = cross;
+	args[i].boxes = boxes;
+	args[i].start = &start;
+	args[i].done = &done;
+    }
+
+    for (i = 0; i < nthreads; i++) 
+	if ((errno = pthread_create(&tids[i], NULL, mt_replay, &args[i])) != 0)
+	    unix_error("pthread_create failed in mt_run");
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tids[i], NULL);
+
+    t0 = args[0].t0;
+    t1 = args[0].t1;
+    for (i = 0; i < nthreads; i++) {
+	t0 = (args[i].t0 < t0) ? args[i].t0 : t0;
+	t1 = (args[i].t1 > t1) ? args[i].t1 : t1;
+	free(args[i].blocks);
+	pthread_mutex_destroy(&boxes[i].lock);
+	free(boxes[i].ptrs);
+    }
+    pthread_barrier_destroy(&start);
+    pthread_barrier_destroy(&done);
+    free(boxes);
+    free(tids);
+    return t1 - t0;
+}
+
+/*
+ * mt_replay - Thread routine: replay one trace against libc or mm.
+ *    Blocks still live at the end of the trace are freed outside the
+ *    timed region, so repeated runs start from a clean heap.
+ */
+static void *mt_replay(void *vargp)
+{
+    mtarg_t *arg = (mtarg_t *)vargp;
+    trace_t *trace = arg->trace;
+    char **blocks = arg->blocks;
+    int i, index;
+    char *p;
+
+    pthread_barrier_wait(arg->start);
+    arg->t0 = mt_now();
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+	    p = arg->libc ? malloc(trace->ops[i].size) 
+		          : mm_malloc(trace->ops[i].size);
+	    if (p == NULL)
+		app_error("malloc failed in mt_replay");
+	    blocks[index] = p;
+	    break;
+
+	case REALLOC: /* realloc */
+	    p = arg->libc ? realloc(blocks[index], trace->ops[i].size)
+		          : mm_realloc(blocks[index], trace->ops[i].size);
+	    if (p == NULL)
+		app_error("realloc failed in mt_replay");
+	    blocks[index] = p;
+	    break;
+
+        case FREE: /* free */
+	    mt_free(arg, blocks[index]);
+	    blocks[index] = NULL;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in mt_replay");
+	}
+
+	/* Perform the frees other threads have handed to us */
+	if (arg->cross && __atomic_load_n(&arg->boxes[arg->tid].count, __ATOMIC_RELAXED) > 0)
+	    mt_drain(arg);
+    }
+
+    /* Post the last partial batch, then wait for everyone else's */
+    if (arg->cross) {
+	mt_post(arg);
+	pthread_barrier_wait(arg->done);
+	mt_drain(arg);
+    }
+    arg->t1 = mt_now();
+
+    /* Release whatever the trace left allocated */
+    for (i = 0; i < trace->num_ids; i++) 
+	if (blocks[i] != NULL) {
+	    if (arg->libc)
+		free(blocks[i]);
+	    else
+		mm_free(blocks[i]);
+	}
+
+    return NULL;
+}
+
+/*
+ * mt_free - Free a block now, or queue it for the next thread in -x mode
+ */
+static void mt_free(mtarg_t *arg, char *p)
+{
+    if (!arg->cross) {
+	if (arg->libc)
+	    free(p);
+	else
+	    mm_free(p);
+	return;
+    }
+
+    arg->outbox[arg->nout++] = p;
+    if (arg->nout == MT_BATCH)
+	mt_post(arg);
+}
+
+/*
+ * mt_post - Append the local batch of frees to the next thread's mailbox
+ */
+static void mt_post(mtarg_t *arg)
+{
+    mailbox_t *box = &arg->boxes[(arg->tid + 1) % arg->nthreads];
+
+    if (arg->nout == 0)
+	return;
+
+    pthread_mutex_lock(&box->lock);
+    if (box->count + arg->nout > box->capacity) {
+	box->capacity = 2*(box->count + arg->nout);
+	if ((box->ptrs = (char **)realloc(box->ptrs, 
+				     box->capacity*sizeof(char *))) == NULL)
+	    unix_error("realloc failed in mt_post");
+    }
+    memcpy(box->ptrs + box->count, arg->outbox, arg->nout*sizeof(char *));
+    __atomic_store_n(&box->count, box->count + arg->nout, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&box->lock);
+    arg->nout = 0;
+}
+
+/*
+ * mt_drain - Free every block that other threads posted to our mailbox
+ */
+static void mt_drain(mtarg_t *arg)
+{
+    mailbox_t *box = &arg->boxes[arg->tid];
+    int i;
+
+    pthread_mutex_lock(&box->lock);
+    for (i = 0; i < box->count; i++) {
+	if (arg->libc)
+	    free(box->ptrs[i]);
+	else
+	    mm_free(box->ptrs[i]);
+    }
+    __atomic_store_n(&box->count, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&box->lock);
+}
+
+/*
+ * eval_cache - Run the small-block cache benchmark with mm's caches off,
+ *    per thread and per CPU, and report the throughput and how much
+ *    memory the caches hold once every thread has freed its blocks.
+ *    If heapcheck, also check the payloads and the heap, and return
+ *    the number of modes that failed.
+ */
+static int eval_cache(int nthreads, int heapcheck)
+{
+#ifndef MM_THREADSAFE
+    printf("Skipping the cache benchmark: mm.c was not built "
+	   "thread-safe (rebuild with make THREADSAFE=1)\n");
+    return 0;
+#else
+    static const int modes[] = {MM_CACHE_OFF, MM_CACHE_THREAD, MM_CACHE_CPU};
+    static const char *names[] = {"off", "thread", "cpu"};
+    cachearg_t *args;
+    pthread_t *tids;
+    pthread_attr_t attr;
+    pthread_barrier_t start, done, leave;
+    struct mm_stats st;
+    double t0, t1;
+    long bad;
+    int m, i, failed = 0, heapbad;
+
+    if ((args = (cachearg_t *)calloc(nthreads, sizeof(cachearg_t))) == NULL)
+	unix_error("args calloc in eval_cache failed");
+    if ((tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) == NULL)
+	unix_error("tids calloc in eval_cache failed");
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CACHE_STACK);
+
+    mem_init();
+    printf("Small-block caches: %d threads on %ld CPUs, %d ops each\n",
+	   nthreads, sysconf(_SC_NPROCESSORS_ONLN), CACHE_ITERS);
+    printf("%-8s%8s%10s%10s%12s%s\n", "asked", "got", "secs", "Mops/s", 
+	   "cached KB", heapcheck ? "   check" : "");
+    for (m = 0; m < 3; m++) {
+	mm_set_cache(modes[m]);
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_cache");
+	pthread_barrier_init(&start, NULL, nthreads);
+	pthread_barrier_init(&done, NULL, nthreads + 1);
+	pthread_barrier_init(&leave, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+	    args[i].tid = i;
+	    args[i].check = heapcheck;
+	    args[i].bad = 0;
+	    args[i].start = &start;
+	    args[i].done = &done;
+	    args[i].leave = &leave;
+	    if ((errno = pthread_create(&tids[i], &attr, cache_run, &args[i])) != 0)
+		unix_error("pthread_create failed in eval_cache");
+	}
+	pthread_barrier_wait(&done);
+	mm_stats(&st);
+	heapbad = heapcheck && mm_check(1) != 0;
+	pthread_barrier_wait(&leave);
+	for (i = 0; i < nthreads; i++)
+	    pthread_join(tids[i], NULL);
+	if (heapcheck && mm_check(1) != 0)
+	    heapbad = 1;
+	pthread_barrier_destroy(&start);
+	pthread_barrier_destroy(&done);
+	pthread_barrier_destroy(&leave);
+
+	t0 = args[0].t0;
+	t1 = args[0].t1;
+	bad = 0;
+	for (i = 0; i < nthreads; i++) {
+	    t0 = (args[i].t0 < t0) ? args[i].t0 : t0;
+	    t1 = (args[i].t1 > t1) ? args[i].t1 : t1;
+	    bad += args[i].bad;
+	}
+	printf("%-8s%8s%10.4f%10.1f%12.1f", names[m], 
+	       names[mm_cache_mode()], t1 - t0, 
+	       (double)nthreads * CACHE_ITERS / 1e6 / (t1 - t0),
+	       st.allocated / 1024.0);
+	if (heapcheck) {
+	    if (bad > 0)
+		printf("   %ld blocks overwritten", bad);
+	    else if (heapbad)
+		printf("   mm_check failed");
+	    else
+		printf("   ok");
+	    failed += (bad > 0 || heapbad);
+	}
+	printf("\n");
+	fflush(stdout);
+    }
+    mm_set_cache(MM_CACHE_OFF);
+    pthread_attr_destroy(&attr);
+    free(args);
+    free(tids);
+    return failed;
+#endif
+}
+
+#ifdef MM_THREADSAFE
+/*
+ * cache_verify - 1 if any of the size bytes at p is not fill, else 0
+ */
+static int cache_verify(const char *p, int size, unsigned char fill)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+	if ((unsigned char)p[i] != fill)
+	    return 1;
+    return 0;
+}
+
+/*
+ * cache_run - Thread routine of the cache benchmark
+ */
+static void *cache_run(void *vargp)
+{
+    cachearg_t *arg = (cachearg_t *)vargp;
+    char *blocks[CACHE_BLOCKS];
+    int sizes[CACHE_BLOCKS];
+    unsigned char fill[CACHE_BLOCKS];
+    unsigned int seed = arg->tid * 2654435761u + 1;
+    int i, k;
+
+    memset(blocks, 0, sizeof(blocks));
+    pthread_barrier_wait(arg->start);
+    arg->t0 = mt_now();
+    for (i = 0; i < CACHE_ITERS; i++) {
+	seed = seed * 1103515245 + 12345;
+	k = (seed >> 16) % CACHE_BLOCKS;
+	if (blocks[k] != NULL) {
+	    if (arg->check)
+		arg->bad += cache_verify(blocks[k], sizes[k], fill[k]);
+	    mm_free(blocks[k]);
+	    blocks[k] = NULL;
+	} else {
+	    sizes[k] = 1 + (seed >> 4) % CACHE_SIZE;
+	    if ((blocks[k] = mm_malloc(sizes[k])) == NULL)
+		app_error("mm_malloc failed in cache_run");
+	    if (arg->check) {
+		fill[k] = (unsigned char)(arg->tid + i);
+		memset(blocks[k], fill[k], sizes[k]);
+	    } else
+		blocks[k][0] = 1;
+	}
+    }
+    for (k = 0; k < CACHE_BLOCKS; k++) {
+	if (blocks[k] != NULL) {
+	    if (arg->check)
+		arg->bad += cache_verify(blocks[k], sizes[k], fill[k]);
+	    mm_free(blocks[k]);
+	}
+    }
+    arg->t1 = mt_now();
+    pthread_barrier_wait(arg->done);
+    pthread_barrier_wait(arg->leave);
+    return NULL;
+}
+#endif
+
+/*
+ * eval_share - Run the false-sharing benchmark with the objects from a
+ *    shared heap, from per-thread heaps (MM_PLACE_THREAD) and from
+ *    mm_malloc_hot, and report how many objects share a cache line with
+ *    another thread's and how fast the writes go.
+ */
+static void eval_share(int nthreads)
+{
+#ifndef MM_THREADSAFE
+    printf("Skipping the false-sharing benchmark: mm.c was not built "
+	   "thread-safe (rebuild with make THREADSAFE=1)\n");
+#else
+    static const char *modes[] = { "shared", "thread", "hot" };
+    sharearg_t *args;
+    pthread_t *tids;
+    pthread_barrier_t start;
+    volatile int turn;
+    double t0, t1;
+    size_t lo, hi, lo2, hi2;
+    int m, i, j, k, l, nshared;
+
+    if ((args = (sharearg_t *)calloc(nthreads, sizeof(sharearg_t))) == NULL)
+	unix_error("args calloc in eval_share failed");
+    if ((tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) == NULL)
+	unix_error("tids calloc in eval_share failed");
+
+    mem_init();
+    printf("False sharing: %d threads, %d objects of %d bytes each, "
+	   "%d writes to each\n", nthreads, SHARE_OBJS, SHARE_SIZE, SHARE_ITERS);
+    printf("%-8s%14s%10s%12s\n", "mode", "shared objs", "secs", "Mwrites/s");
+    for (m = 0; m < 3; m++) {
+	mm_set_placement(m == 1 ? MM_PLACE_THREAD : MM_PLACE_SHARED);
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_share");
+	turn = 0;
+	pthread_barrier_init(&start, NULL, nthreads);
+	for (i = 0; i < nthreads; i++) {
+	    memset(&args[i], 0, sizeof(sharearg_t));
+	    args[i].tid = i;
+	    args[i].nthreads = nthreads;
+	    args[i].hot = (m == 2);
+	    args[i].turn = &turn;
+	    args[i].start = &start;
+	}
+	for (i = 0; i < nthreads; i++) 
+	    if ((errno = pthread_create(&tids[i], NULL, share_run, &args[i])) != 0)
+		unix_error("pthread_create failed in eval_share");
+	for (i = 0; i < nthreads; i++)
+	    pthread_join(tids[i], NULL);
+	pthread_barrier_destroy(&start);
+
+	/* Objects with a cache line in common with another thread's */
+	nshared = 0;
+	for (i = 0; i < nthreads; i++) {
+	    for (k = 0; k < SHARE_OBJS; k++) {
+		lo = (size_t)args[i].objs[k] / MM_CACHELINE;
+		hi = ((size_t)args[i].objs[k] + SHARE_SIZE - 1) / MM_CACHELINE;
+		for (j = 0; j < nthreads; j++) {
+		    if (j == i)
+			continue;
+		    for (l = 0; l < SHARE_OBJS; l++) {
+			lo2 = (size_t)args[j].objs[l] / MM_CACHELINE;
+			hi2 = ((size_t)args[j].objs[l] + SHARE_SIZE - 1) / MM_CACHELINE;
+			if (lo <= hi2 && lo2 <= hi)
+			    break;
+		    }
+		    if (l < SHARE_OBJS)
+			break;
+		}
+		nshared += (j < nthreads);
+	    }
+	}
+
+	t0 = args[0].t0;
+	t1 = args[0].t1;
+	for (i = 0; i < nthreads; i++) {
+	    t0 = (args[i].t0 < t0) ? args[i].t0 : t0;
+	    t1 = (args[i].t1 > t1) ? args[i].t1 : t1;
+	    for (k = 0; k < SHARE_OBJS; k++) {
+		if (*(long *)args[i].objs[k] != SHARE_ITERS)
+		    app_error("object counts are off in eval_share (overlapping blocks?)");
+		mm_free(args[i].objs[k]);
+	    }
+	}
+	printf("%-8s%8d/%-5d%10.6f%12.1f\n", modes[m], nshared, 
+	       nthreads * SHARE_OBJS, t1 - t0, 
+	       (double)nthreads * SHARE_OBJS * SHARE_ITERS / 1e6 / (t1 - t0));
+    }
+    mm_set_placement(MM_PLACE_SHARED);
+    free(args);
+    free(tids);
+#endif
+}
+
+#ifdef MM_THREADSAFE
+/*
+ * share_run - Thread routine of the false-sharing benchmark: allocate in
+ *    turn with the other threads, then hammer the objects.
+ */
+static void *share_run(void *vargp)
+{
+    sharearg_t *arg = (sharearg_t *)vargp;
+    int i, k;
+
+    for (k = 0; k < SHARE_OBJS; k++) {
+	while (*arg->turn % arg->nthreads != arg->tid)
+	    sched_yield();
+	if (arg->hot)
+	    arg->objs[k] = mm_malloc_hot(SHARE_SIZE);
+	else
+	    arg->objs[k] = mm_malloc(SHARE_SIZE);
+	if (arg->objs[k] == NULL)
+	    app_error("mm_malloc failed in share_run");
+	memset(arg->objs[k], 0, SHARE_SIZE);
+	__sync_fetch_and_add(arg->turn, 1);
+    }
+
+    pthread_barrier_wait(arg->start);
+    arg->t0 = mt_now();
+    for (i = 0; i < SHARE_ITERS; i++)
+	for (k = 0; k < SHARE_OBJS; k++)
+	    (*(volatile long *)arg->objs[k])++;
+    arg->t1 = mt_now();
+    return NULL;
+}
+#endif
+
+/*
+ * mt_now - Current time in seconds from the monotonic clock
+ */
+static double mt_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -926,17 +3094,23 @@ static void printresults(int n, stats_t *stats)
     double util = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%10s%7s%6s%8s%6s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", 
+	   "min", "sd", "runs", "heapK", "sbrk");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f%10.6f%6.1f%%%6d%8lu%6d\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].secs_min,
+		   stats[i].secs_sd/stats[i].secs*100.0,
+		   stats[i].runs,
+		   (unsigned long)stats[i].heapsize/1024,
+		   stats[i].sbrks);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
@@ -1004,14 +3178,39 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValxKLNPcC] [-f <file>] [-t <dir>] [-j <n>] [-k <n>]\n"
+	    "               [-r <n>] [-o json|csv[:<file>]] [-B <file>] [-F <n>]\n"
+	    "               [-G <bytes>] [-p <bytes>] [-e <engine>|list|all]\n"
+	    "               [-H 4k|thp|hugetlb] [-T] [-M <n>] [-S <n>]\n"
+	    "               [-O <knob>=<value>[,<value>...]]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-c         Run mm_check after every request.\n");
+    fprintf(stderr, "\t-C         Have mm check the blocks each request touched.\n");
+    fprintf(stderr, "\t-B <file>  Compare against a baseline written by -o csv.\n");
+    fprintf(stderr, "\t-e <name>  Use mm engine <name>; list them, or compare all.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F <n>     Analyze fragmentation every <n> requests.\n");
+    fprintf(stderr, "\t-G <bytes> Put blocks this big below a guard page (DEBUG=1 mm).\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <kind>  Back the heap with 4k, thp or hugetlb pages.\n");
+    fprintf(stderr, "\t-j <n>     Replay the traces concurrently on <n> threads.\n");
+    fprintf(stderr, "\t-k <n>     Run the small-block cache benchmark on <n> threads (with -c, check it).\n");
+    fprintf(stderr, "\t-K         Compare mm's copy/zero kernels on the realloc traces.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-M <n>     Spread each trace's blocks over <n> mm heaps.\n");
+    fprintf(stderr, "\t-L         Print per-op latency percentiles.\n");
+    fprintf(stderr, "\t-N         Give each NUMA node an mm arena of its own.\n");
+    fprintf(stderr, "\t-O <k>=<v> Set mm knob <k> (mm_ctl); compare values split by ':'.\n");
+    fprintf(stderr, "\t-o <fmt>   Write results as json or csv (to stdout or :<file>).\n");
+    fprintf(stderr, "\t-p <bytes> Write a heap profile sampled every <bytes> at each peak.\n");
+    fprintf(stderr, "\t-P         Print hardware performance counters.\n");
+    fprintf(stderr, "\t-r <n>     Time each trace <n> times (mean and spread).\n");
+    fprintf(stderr, "\t-S <n>     Run the false-sharing benchmark on <n> threads.\n");
+    fprintf(stderr, "\t-T         Compare throughput and dTLB misses on 4K and huge pages (not with -N).\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-x         With -j, free each block on another thread.\n");
 }
@@ -8,30 +8,91 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <string.h>
 #include <errno.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * A region is one simulated heap: a reserved address range with its
+ * own brk. mem_init sets up the default region; mem_region_create makes
+ * more, and mem_region_use picks the one that mem_sbrk and friends act on.
+ */
+struct mem_region {
+    char *start_brk;         /* points to first byte of heap */
+    char *brk;               /* points to last byte of heap */
+    char *max_addr;          /* largest legal heap address */ 
+    char *committed;         /* end of the accessible part of the range */
+    size_t commit;           /* granularity of commits */
+    size_t maplen;           /* length of the reserved range */
+    int sbrks;               /* successful mem_sbrk calls since the reset */
+    int got;                 /* backing the region actually has */
+    struct mem_region *next; /* all live regions */
+};
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static mem_region_t mem_default;             /* the region of mem_init */
+static mem_region_t *mem = &mem_default;     /* the region in use */
+static mem_region_t *mem_regions = NULL;     /* every live region */
+static int mem_kind = MEM_PAGES_4K;  /* backing asked for by mem_set_pages */
+
+/* From <linux/mman.h> (Linux 5.14), for older headers */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* From <numaif.h>, which comes with libnuma */
+#define MEM_MPOL_PREFERRED 1
+#define MEM_MPOL_MF_MOVE   (1 << 1)
+
+static int mem_map(mem_region_t *r, size_t bytes);
+static char *mem_reserve(mem_region_t *r, int kind, size_t bytes);
+static char *mem_map_hugetlb(mem_region_t *r, size_t bytes);
+
+/*
+ * mem_set_pages - choose the backing of the heap for the next mem_init
+ */
+void mem_set_pages(int kind)
+{
+    mem_kind = kind;
+}
+
+/*
+ * mem_pages - the backing of the current heap
+ */
+int mem_pages(void)
+{
+    return mem->got;
+}
+
+/*
+ * mem_pages_name - printable name of a backing
+ */
+const char *mem_pages_name(int kind)
+{
+    switch (kind) {
+    case MEM_PAGES_THP:     return "thp";
+    case MEM_PAGES_HUGETLB: return "hugetlb";
+    default:                return "4k";
+    }
+}
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. The heap's address
+ *    range is only reserved here (PROT_NONE, so it costs neither RSS
+ *    nor commit charge); mem_sbrk makes it accessible as brk moves up.
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    if (mem_default.start_brk != NULL)
+	mem_region_destroy(&mem_default);
+    if (mem_map(&mem_default, MAX_HEAP) < 0) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
-
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem = &mem_default;
 }
 
 /* 
@@ -39,7 +100,220 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_region_destroy(&mem_default);
+    mem = &mem_default;
+}
+
+/*
+ * mem_region_create - set up another, empty heap of up to bytes (0 for
+ *    MAX_HEAP) on the backing of mem_set_pages. NULL if its range can't
+ *    be reserved. A 32-bit process has room for only a few MAX_HEAP
+ *    ranges, so callers that make many regions ask for less.
+ */
+mem_region_t *mem_region_create(size_t bytes)
+{
+    mem_region_t *r;
+
+    if ((r = calloc(1, sizeof(mem_region_t))) == NULL)
+	return NULL;
+    if (mem_map(r, (bytes == 0 || bytes > MAX_HEAP) ? MAX_HEAP : bytes) < 0) {
+	free(r);
+	return NULL;
+    }
+    return r;
+}
+
+/*
+ * mem_region_destroy - unmap a region. It must not be in use.
+ */
+void mem_region_destroy(mem_region_t *r)
+{
+    mem_region_t **pp;
+
+    for (pp = &mem_regions; *pp != NULL; pp = &(*pp)->next) {
+	if (*pp == r) {
+	    *pp = r->next;
+	    break;
+	}
+    }
+    munmap(r->start_brk, r->maplen);
+    if (r != &mem_default)
+	free(r);
+    else
+	memset(r, 0, sizeof(mem_region_t));
+}
+
+/*
+ * mem_region_use - make r (NULL for the default region) the heap that
+ *    mem_sbrk, mem_heap_lo and the like work on. Returns the old one.
+ */
+mem_region_t *mem_region_use(mem_region_t *r)
+{
+    mem_region_t *old = mem;
+
+    mem = (r != NULL) ? r : &mem_default;
+    return old;
+}
+
+/*
+ * mem_region_bind - have r's pages (NULL = the default region's) come
+ *    from NUMA node node. The policy is only a preference, so the heap
+ *    still grows if the node runs out, and pages already faulted in are
+ *    moved. Called through syscall() so there's no libnuma dependency;
+ *    returns -1 where mbind is missing or not allowed.
+ */
+int mem_region_bind(mem_region_t *r, int node)
+{
+#ifdef SYS_mbind
+    unsigned long mask[MEM_MAX_NODES / (8 * sizeof(unsigned long))];
+
+    if (r == NULL)
+	r = &mem_default;
+    if (node < 0 || node >= MEM_MAX_NODES)
+	return -1;
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    return (int)syscall(SYS_mbind, r->start_brk, r->maplen, MEM_MPOL_PREFERRED,
+			mask, (unsigned long)MEM_MAX_NODES + 1, MEM_MPOL_MF_MOVE);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * mem_region_range - r's reserved range, [*lo, *hi)
+ */
+void mem_region_range(mem_region_t *r, void **lo, void **hi)
+{
+    *lo = r->start_brk;
+    *hi = r->max_addr;
+}
+
+/*
+ * mem_region_owns - does p lie anywhere in r's reserved range?
+ */
+int mem_region_owns(mem_region_t *r, void *p)
+{
+    return (char *)p >= r->start_brk && (char *)p < r->max_addr;
+}
+
+/*
+ * mem_heap_contains - does [lo, hi] lie in the extent of one heap?
+ */
+int mem_heap_contains(void *lo, void *hi)
+{
+    mem_region_t *r;
+
+    for (r = mem_regions; r != NULL; r = r->next)
+	if ((char *)lo >= r->start_brk && (char *)hi < r->brk)
+	    return 1;
+    return 0;
+}
+
+/*
+ * mem_total_heapsize - the sizes of all heaps together
+ */
+size_t mem_total_heapsize(void)
+{
+    mem_region_t *r;
+    size_t total = 0;
+
+    for (r = mem_regions; r != NULL; r = r->next)
+	total += (size_t)(r->brk - r->start_brk);
+    return total;
+}
+
+/*
+ * mem_map - reserve bytes for r's range, on hugetlbfs pages if asked
+ *    and there are any, and link it into mem_regions
+ */
+static int mem_map(mem_region_t *r, size_t bytes)
+{
+    r->start_brk = NULL;
+    if (mem_kind == MEM_PAGES_HUGETLB)
+	r->start_brk = mem_map_hugetlb(r, bytes);
+    if (r->start_brk == NULL)
+	r->start_brk = mem_reserve(r, mem_kind, bytes);
+    if (r->start_brk == NULL)
+	return -1;
+
+    r->max_addr = r->start_brk + r->maplen;  /* max legal heap address */
+    r->brk = r->start_brk;                   /* heap is empty initially */
+    r->sbrks = 0;
+    r->next = mem_regions;
+    mem_regions = r;
+    return 0;
+}
+
+/*
+ * mem_reserve - reserve bytes of address space, aligned to a huge page
+ *    and advised for transparent huge pages if kind asks for them.
+ *    Pages are committed MEM_COMMIT bytes (a huge page for THP) at a
+ *    time by mem_sbrk.
+ */
+static char *mem_reserve(mem_region_t *r, int kind, size_t bytes)
+{
+    size_t align = (kind == MEM_PAGES_4K) ? mem_pagesize() : MEM_HUGEPAGE;
+    size_t len = (bytes + MEM_HUGEPAGE - 1) & ~(size_t)(MEM_HUGEPAGE - 1);
+    char *p, *aligned;
+
+    /* Over-reserve by the alignment and trim the ends */
+    p = mmap(NULL, len + align, PROT_NONE, 
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+	return NULL;
+    aligned = (char *)(((size_t)p + align - 1) & ~(size_t)(align - 1));
+    if (aligned > p)
+	munmap(p, aligned - p);
+    munmap(aligned + len, p + align - aligned);
+#ifdef MADV_HUGEPAGE
+    if (kind != MEM_PAGES_4K)
+	madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+    r->maplen = len;
+    r->commit = (kind == MEM_PAGES_4K) ? MEM_COMMIT : MEM_HUGEPAGE;
+    r->committed = aligned;
+    r->got = (kind == MEM_PAGES_4K) ? MEM_PAGES_4K : MEM_PAGES_THP;
+    return aligned;
+}
+
+/*
+ * mem_map_hugetlb - map the heap on hugetlbfs pages. The kernel won't
+ *    overcommit those, so map (and reserve) only as many as are free,
+ *    up to bytes. NULL if there are none.
+ */
+static char *mem_map_hugetlb(mem_region_t *r, size_t bytes)
+{
+#ifdef MAP_HUGETLB
+    FILE *fp;
+    char line[128];
+    unsigned long nfree = 0;
+    size_t len;
+    char *p;
+
+    if ((fp = fopen("/proc/meminfo", "r")) == NULL)
+	return NULL;
+    while (fgets(line, sizeof(line), fp) != NULL)
+	if (sscanf(line, "HugePages_Free: %lu", &nfree) == 1)
+	    break;
+    fclose(fp);
+    if (nfree == 0)
+	return NULL;
+
+    len = nfree * (size_t)MEM_HUGEPAGE;
+    if (len > bytes)
+	len = (bytes + MEM_HUGEPAGE - 1) & ~(size_t)(MEM_HUGEPAGE - 1);
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED)
+	return NULL;
+    r->maplen = len;
+    r->committed = p + len;
+    r->got = MEM_PAGES_HUGETLB;
+    return p;
+#else
+    return NULL;
+#endif
 }
 
 /*
@@ -47,33 +321,110 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    mem->brk = mem->start_brk;
+    mem->sbrks = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap cannot be shrunk. Memory stays committed
+ *    across mem_reset_brk, so only the first run pays for the faults.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk = mem->brk;
+    size_t len;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( (incr < 0) || (incr > mem->max_addr - mem->brk)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
-    mem_brk += incr;
+
+    /* Commit whole MEM_COMMIT units of the reservation up to the new brk */
+    if (mem->brk + incr > mem->committed) {
+	len = ((mem->brk + incr - mem->committed) + mem->commit - 1) & ~(mem->commit - 1);
+	if (len > (size_t)(mem->max_addr - mem->committed))
+	    len = mem->max_addr - mem->committed;
+	if (mprotect(mem->committed, len, PROT_READ | PROT_WRITE) < 0) {
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+	    return (void *)-1;
+	}
+	mem->committed += len;
+    }
+    mem->brk += incr;
+    mem->sbrks++;
     return (void *)old_brk;
 }
 
+/*
+ * mem_purge - give the pages inside [lo, hi) back with MADV_DONTNEED.
+ *    Pages are huge pages on a hugetlb region, and must be whole.
+ */
+size_t mem_purge(void *lo, void *hi)
+{
+    size_t page = (mem->got == MEM_PAGES_HUGETLB) ? MEM_HUGEPAGE : mem_pagesize();
+    char *a = (char *)(((size_t)lo + page - 1) & ~(page - 1));
+    char *b = (char *)((size_t)hi & ~(page - 1));
+
+    if (a >= b || madvise(a, b - a, MADV_DONTNEED) < 0)
+	return 0;
+    return b - a;
+}
+
+/*
+ * mem_trim - purge the committed memory above the brk
+ */
+size_t mem_trim(void)
+{
+    return mem_purge(mem->brk, mem->committed);
+}
+
+/*
+ * mem_prefault - commit the next bytes above the brk like mem_sbrk would,
+ *    then populate them: with MADV_POPULATE_WRITE, or on older kernels by
+ *    writing every page its own first byte back.
+ */
+size_t mem_prefault(size_t bytes)
+{
+    size_t page = mem_pagesize();
+    char *top, *p;
+    size_t len;
+
+    if (bytes > (size_t)(mem->max_addr - mem->brk))
+	bytes = mem->max_addr - mem->brk;
+    top = mem->brk + bytes;
+    if (top > mem->committed) {
+	len = ((top - mem->committed) + mem->commit - 1) & ~(mem->commit - 1);
+	if (len > (size_t)(mem->max_addr - mem->committed))
+	    len = mem->max_addr - mem->committed;
+	if (mprotect(mem->committed, len, PROT_READ | PROT_WRITE) < 0)
+	    return 0;
+	mem->committed += len;
+    }
+    p = (char *)((size_t)mem->brk & ~(page - 1));
+    if (madvise(p, top - p, MADV_POPULATE_WRITE) < 0)
+	for (; p < top; p += page)
+	    *(volatile char *)p = *(volatile char *)p;
+    return bytes;
+}
+
+/*
+ * mem_sbrk_calls - how many times the heap was extended since the last
+ *    mem_reset_brk, to see how an allocator's growth policy behaves
+ */
+int mem_sbrk_calls(void)
+{
+    return mem->sbrks;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
 void *mem_heap_lo()
 {
-    return (void *)mem_start_brk;
+    return (void *)mem->start_brk;
 }
 
 /* 
@@ -81,7 +432,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(mem->brk - 1);
 }
 
 /*
@@ -89,7 +440,7 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return (size_t)(mem->brk - mem->start_brk);
 }
 
 /*
@@ -1,5 +1,21 @@
 #include <unistd.h>
 
+/* 
+ * What backs the simulated heap. mem_set_pages picks it for the next
+ * mem_init; mem_pages reports what mem_init actually got, since
+ * MAP_HUGETLB fails unless huge pages were reserved (vm.nr_hugepages).
+ */
+#define MEM_PAGES_4K      0   /* ordinary pages (the default) */
+#define MEM_PAGES_THP     1   /* 2 MB aligned, MADV_HUGEPAGE */
+#define MEM_PAGES_HUGETLB 2   /* MAP_HUGETLB, else falls back to THP */
+#define MEM_HUGEPAGE      (2*(1<<20))
+#define MEM_COMMIT        (64*(1<<10))  /* commit step on 4K pages */
+#define MEM_MAX_NODES     1024          /* NUMA nodes mem_region_bind handles */
+
+void mem_set_pages(int kind);
+int mem_pages(void);
+const char *mem_pages_name(int kind);
+
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
@@ -8,4 +24,33 @@ void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+int mem_sbrk_calls(void);
+
+/*
+ * Giving memory back and fetching it ahead of time. mem_purge returns
+ * the pages wholly inside [lo, hi) to the system (they read as zeros
+ * when touched again), mem_trim those committed above the brk, and
+ * mem_prefault commits and populates the next bytes above the brk so
+ * the heap grows into them without faulting. Each returns the bytes it
+ * covered.
+ */
+size_t mem_purge(void *lo, void *hi);
+size_t mem_trim(void);
+size_t mem_prefault(size_t bytes);
+
+/*
+ * More heaps besides the one mem_init sets up, each with its own
+ * reserved range and brk. The functions above work on the region
+ * picked with mem_region_use (NULL = the default one).
+ */
+typedef struct mem_region mem_region_t;
+
+mem_region_t *mem_region_create(size_t bytes);
+void mem_region_destroy(mem_region_t *r);
+mem_region_t *mem_region_use(mem_region_t *r);
+int mem_region_owns(mem_region_t *r, void *p);
+void mem_region_range(mem_region_t *r, void **lo, void **hi);
+int mem_region_bind(mem_region_t *r, int node);
+int mem_heap_contains(void *lo, void *hi);
+size_t mem_total_heapsize(void);
 
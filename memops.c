@@ -0,0 +1,277 @@
+/*
+ * memops.c - copy and zero kernels for mm's payloads
+ *
+ * The SSE2 and AVX2 kernels are compiled for their instruction set with
+ * target attributes, so the rest of the program keeps the baseline
+ * flags and only runs them on a CPU that has them. Each one copies the
+ * unaligned head with memcpy, then moves 4 vectors per iteration with
+ * aligned stores (the loads may still be unaligned, the source need not
+ * share the destination's alignment), and leaves the tail to memcpy.
+ */
+#include <string.h>
+#include <stdint.h>
+#include "memops.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define MEMOPS_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    void (*copy)(void *, const void *, size_t);
+    void (*zero)(void *, size_t);
+} kernel_t;
+
+/*
+ * The libc kernel
+ */
+static int libc_supported(void)
+{
+    return 1;
+}
+
+static void libc_copy(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+static void libc_zero(void *dst, size_t n)
+{
+    memset(dst, 0, n);
+}
+
+#ifdef MEMOPS_X86
+/*
+ * The SSE2 kernel, 16-byte stores
+ */
+static int sse2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static void sse2_copy(void *dst, const void *src, size_t n)
+{
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    size_t head = -(uintptr_t)d & 15;
+    __m128i a, b, c, e;
+
+    if (n < 64 + head) {
+	memcpy(d, s, n);
+	return;
+    }
+    memcpy(d, s, head);
+    d += head, s += head, n -= head;
+    if (n >= MEMOPS_NT) {
+	for (; n >= 64; d += 64, s += 64, n -= 64) {
+	    a = _mm_loadu_si128((const __m128i *)s);
+	    b = _mm_loadu_si128((const __m128i *)(s + 16));
+	    c = _mm_loadu_si128((const __m128i *)(s + 32));
+	    e = _mm_loadu_si128((const __m128i *)(s + 48));
+	    _mm_stream_si128((__m128i *)d, a);
+	    _mm_stream_si128((__m128i *)(d + 16), b);
+	    _mm_stream_si128((__m128i *)(d + 32), c);
+	    _mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	_mm_sfence();
+    } else {
+	for (; n >= 64; d += 64, s += 64, n -= 64) {
+	    a = _mm_loadu_si128((const __m128i *)s);
+	    b = _mm_loadu_si128((const __m128i *)(s + 16));
+	    c = _mm_loadu_si128((const __m128i *)(s + 32));
+	    e = _mm_loadu_si128((const __m128i *)(s + 48));
+	    _mm_store_si128((__m128i *)d, a);
+	    _mm_store_si128((__m128i *)(d + 16), b);
+	    _mm_store_si128((__m128i *)(d + 32), c);
+	    _mm_store_si128((__m128i *)(d + 48), e);
+	}
+    }
+    memcpy(d, s, n);
+}
+
+__attribute__((target("sse2")))
+static void sse2_zero(void *dst, size_t n)
+{
+    char *d = (char *)dst;
+    size_t head = -(uintptr_t)d & 15;
+    __m128i z = _mm_setzero_si128();
+
+    if (n < 64 + head) {
+	memset(d, 0, n);
+	return;
+    }
+    memset(d, 0, head);
+    d += head, n -= head;
+    if (n >= MEMOPS_NT) {
+	for (; n >= 64; d += 64, n -= 64) {
+	    _mm_stream_si128((__m128i *)d, z);
+	    _mm_stream_si128((__m128i *)(d + 16), z);
+	    _mm_stream_si128((__m128i *)(d + 32), z);
+	    _mm_stream_si128((__m128i *)(d + 48), z);
+	}
+	_mm_sfence();
+    } else {
+	for (; n >= 64; d += 64, n -= 64) {
+	    _mm_store_si128((__m128i *)d, z);
+	    _mm_store_si128((__m128i *)(d + 16), z);
+	    _mm_store_si128((__m128i *)(d + 32), z);
+	    _mm_store_si128((__m128i *)(d + 48), z);
+	}
+    }
+    memset(d, 0, n);
+}
+
+/*
+ * The AVX2 kernel, 32-byte stores
+ */
+static int avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy(void *dst, const void *src, size_t n)
+{
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    size_t head = -(uintptr_t)d & 31;
+    __m256i a, b, c, e;
+
+    if (n < 128 + head) {
+	memcpy(d, s, n);
+	return;
+    }
+    memcpy(d, s, head);
+    d += head, s += head, n -= head;
+    if (n >= MEMOPS_NT) {
+	for (; n >= 128; d += 128, s += 128, n -= 128) {
+	    a = _mm256_loadu_si256((const __m256i *)s);
+	    b = _mm256_loadu_si256((const __m256i *)(s + 32));
+	    c = _mm256_loadu_si256((const __m256i *)(s + 64));
+	    e = _mm256_loadu_si256((const __m256i *)(s + 96));
+	    _mm256_stream_si256((__m256i *)d, a);
+	    _mm256_stream_si256((__m256i *)(d + 32), b);
+	    _mm256_stream_si256((__m256i *)(d + 64), c);
+	    _mm256_stream_si256((__m256i *)(d + 96), e);
+	}
+	_mm_sfence();
+    } else {
+	for (; n >= 128; d += 128, s += 128, n -= 128) {
+	    a = _mm256_loadu_si256((const __m256i *)s);
+	    b = _mm256_loadu_si256((const __m256i *)(s + 32));
+	    c = _mm256_loadu_si256((const __m256i *)(s + 64));
+	    e = _mm256_loadu_si256((const __m256i *)(s + 96));
+	    _mm256_store_si256((__m256i *)d, a);
+	    _mm256_store_si256((__m256i *)(d + 32), b);
+	    _mm256_store_si256((__m256i *)(d + 64), c);
+	    _mm256_store_si256((__m256i *)(d + 96), e);
+	}
+    }
+    memcpy(d, s, n);
+}
+
+__attribute__((target("avx2")))
+static void avx2_zero(void *dst, size_t n)
+{
+    char *d = (char *)dst;
+    size_t head = -(uintptr_t)d & 31;
+    __m256i z = _mm256_setzero_si256();
+
+    if (n < 128 + head) {
+	memset(d, 0, n);
+	return;
+    }
+    memset(d, 0, head);
+    d += head, n -= head;
+    if (n >= MEMOPS_NT) {
+	for (; n >= 128; d += 128, n -= 128) {
+	    _mm256_stream_si256((__m256i *)d, z);
+	    _mm256_stream_si256((__m256i *)(d + 32), z);
+	    _mm256_stream_si256((__m256i *)(d + 64), z);
+	    _mm256_stream_si256((__m256i *)(d + 96), z);
+	}
+	_mm_sfence();
+    } else {
+	for (; n >= 128; d += 128, n -= 128) {
+	    _mm256_store_si256((__m256i *)d, z);
+	    _mm256_store_si256((__m256i *)(d + 32), z);
+	    _mm256_store_si256((__m256i *)(d + 64), z);
+	    _mm256_store_si256((__m256i *)(d + 96), z);
+	}
+    }
+    memset(d, 0, n);
+}
+#endif /* MEMOPS_X86 */
+
+/* From worst to best */
+static const kernel_t kernels[] = {
+    {"libc", libc_supported, libc_copy, libc_zero},
+#ifdef MEMOPS_X86
+    {"sse2", sse2_supported, sse2_copy, sse2_zero},
+    {"avx2", avx2_supported, avx2_copy, avx2_zero},
+#endif
+};
+#define NKERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+/* The kernel in use, NULL until the first call picks the best */
+static const kernel_t *kernel = NULL;
+
+static const kernel_t *best_kernel(void)
+{
+    int i;
+
+    for (i = NKERNELS - 1; i > 0; i--)
+	if (kernels[i].supported())
+	    break;
+    return &kernels[i];
+}
+
+void memops_copy(void *dst, const void *src, size_t n)
+{
+    if (kernel == NULL)
+	kernel = best_kernel();
+    kernel->copy(dst, src, n);
+}
+
+void memops_zero(void *dst, size_t n)
+{
+    if (kernel == NULL)
+	kernel = best_kernel();
+    kernel->zero(dst, n);
+}
+
+const char *memops_name(int i)
+{
+    return (i >= 0 && i < NKERNELS) ? kernels[i].name : NULL;
+}
+
+int memops_set(const char *name)
+{
+    int i;
+
+    if (name == NULL) {
+	kernel = best_kernel();
+	return 0;
+    }
+    for (i = 0; i < NKERNELS; i++) {
+	if (strcmp(kernels[i].name, name) == 0) {
+	    if (!kernels[i].supported())
+		return -1;
+	    kernel = &kernels[i];
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+const char *memops_current(void)
+{
+    if (kernel == NULL)
+	kernel = best_kernel();
+    return kernel->name;
+}
@@ -0,0 +1,27 @@
+/*
+ * memops.h - copy and zero kernels for mm's payloads
+ *
+ * memops_copy and memops_zero do what memcpy and memset(p, 0, n) do,
+ * with the best kernel the CPU supports (AVX2, then SSE2, then libc),
+ * picked at the first call. The vector kernels align their stores and
+ * switch to non-temporal stores from MEMOPS_NT bytes on, so a big copy
+ * doesn't push the rest of the heap out of the cache.
+ */
+#include <stddef.h>
+
+/* Smallest copy or zeroing done with non-temporal stores */
+#define MEMOPS_NT (1 << 20)
+
+void memops_copy(void *dst, const void *src, size_t n);
+void memops_zero(void *dst, size_t n);
+
+/*
+ * The kernels, for benchmarking: memops_name(i) is the name of kernel i
+ * ("libc", "sse2", "avx2"), NULL past the last. memops_set selects one
+ * by name, or the best again for NULL; it returns -1 if the name is
+ * unknown or the CPU lacks the instructions. memops_current names the
+ * kernel in use.
+ */
+const char *memops_name(int i);
+int memops_set(const char *name);
+const char *memops_current(void);
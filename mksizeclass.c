@@ -0,0 +1,98 @@
+/*
+ * mksizeclass.c - generate sizeclass.h, the size-class tables of mm.c
+ *
+ * The classes follow from the policy below: block sizes from SC_MIN up
+ * to SC_LINEAR each get a class of their own (spaced SC_ALIGN apart),
+ * and from there to SC_MAX_SMALL every power of two is split into
+ * SC_STEPS evenly spaced classes. Blocks bigger than SC_MAX_SMALL go by
+ * power of two into SC_NLARGE lists, the last one open ended.
+ *
+ * The output is flat tables, so mm.c maps a size to its class with one
+ * indexed load. Regenerate with "make sizeclass.h" after changing the
+ * policy, and check the result in.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The policy */
+#define SC_ALIGN     8      /* block alignment, a power of two */
+#define SC_MIN       16     /* smallest block */
+#define SC_LINEAR    128    /* exact classes up to here */
+#define SC_STEPS     4      /* classes per power of two above SC_LINEAR */
+#define SC_MAX_SMALL 4096   /* largest block with a class of its own */
+#define SC_NLARGE    8      /* power-of-two lists above SC_MAX_SMALL */
+
+#define MAXCLASSES   256
+
+static int log2i(unsigned int v)
+{
+    int k = 0;
+
+    while (v >>= 1)
+	k++;
+    return k;
+}
+
+int main(void)
+{
+    unsigned int size[MAXCLASSES];
+    int n = 0, c, i, step, shift;
+    unsigned int s, p;
+
+    if ((SC_ALIGN & (SC_ALIGN - 1)) || (SC_MAX_SMALL & (SC_MAX_SMALL - 1)) ||
+	SC_MIN % SC_ALIGN || SC_LINEAR % SC_ALIGN || SC_MIN > SC_LINEAR) {
+	fprintf(stderr, "mksizeclass: inconsistent policy\n");
+	exit(1);
+    }
+
+    /* Class sizes */
+    for (s = SC_MIN; s <= SC_LINEAR; s += SC_ALIGN)
+	size[n++] = s;
+    for (p = SC_LINEAR; p < SC_MAX_SMALL; p *= 2) {
+	step = p / SC_STEPS;
+	if (step < SC_ALIGN)
+	    step = SC_ALIGN;
+	for (s = p + step; s <= 2*p && n < MAXCLASSES; s += step)
+	    if (s > size[n-1])
+		size[n++] = s - s % SC_ALIGN;
+    }
+    if (size[n-1] != SC_MAX_SMALL) {
+	fprintf(stderr, "mksizeclass: classes do not end at SC_MAX_SMALL\n");
+	exit(1);
+    }
+    shift = log2i(SC_ALIGN);
+
+    printf("/*\n"
+	   " * sizeclass.h - size-class tables for mm.c\n"
+	   " *\n"
+	   " * Generated by mksizeclass (\"make sizeclass.h\"), do not edit.\n"
+	   " * Policy: align %d, exact classes from %d to %d, %d per power\n"
+	   " * of two up to %d, then %d power-of-two lists.\n"
+	   " */\n",
+	   SC_ALIGN, SC_MIN, SC_LINEAR, SC_STEPS, SC_MAX_SMALL, SC_NLARGE);
+    printf("#define SC_SHIFT          %d\n", shift);
+    printf("#define SC_MAX_SMALL      %d\n", SC_MAX_SMALL);
+    printf("#define SC_MAX_SMALL_LOG2 %d\n", log2i(SC_MAX_SMALL));
+    printf("#define SC_NSMALL         %d\n", n);
+    printf("#define SC_NLARGE         %d\n", SC_NLARGE);
+    printf("#define SC_NLISTS         (SC_NSMALL + SC_NLARGE)\n\n");
+
+    /* Class to block size */
+    printf("/* Block size of each small class */\n");
+    printf("static const unsigned int sc_size[SC_NSMALL] = {");
+    for (c = 0; c < n; c++)
+	printf("%s%5u,", c % 8 ? " " : "\n    ", size[c]);
+    printf("\n};\n\n");
+
+    /* Size to class: the smallest class that holds the size */
+    printf("/* Smallest class holding a block of size s, indexed by "
+	   "s >> SC_SHIFT */\n");
+    printf("static const unsigned char sc_class[(SC_MAX_SMALL >> SC_SHIFT) + 1] = {");
+    for (i = 0, c = 0; i <= (SC_MAX_SMALL >> shift); i++) {
+	while (size[c] < ((unsigned int)i << shift))
+	    c++;
+	printf("%s%2d,", i % 16 ? " " : "\n    ", c);
+    }
+    printf("\n};\n");
+    return 0;
+}
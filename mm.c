@@ -10,14 +10,69 @@
  * because it doesn't require searching the entire free list. The coelescing is done in 
  * constant time because we added prologue and epilouge blocks. 
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <execinfo.h>
+#include <sched.h>
+#include <time.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "memops.h"
+#include "bitmap.h"
+#include "sizeclass.h"
+
+/*
+ * Building with -DMM_THREADSAFE (make THREADSAFE=1) serializes every public
+ * entry point behind a single mutex so the driver can replay traces from
+ * several threads at once. The default build takes no lock at all.
+ */
+#ifdef MM_THREADSAFE
+#include <pthread.h>
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()				pthread_mutex_lock(&mm_lock)
+#define UNLOCK()			pthread_mutex_unlock(&mm_lock)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+/*
+ * Operation counters for mm_stats. Every thread bumps its own copy
+ * without atomics or the lock; mm_stats sums the copies of the live
+ * threads with the totals folded in by threads that have exited.
+ */
+typedef struct opcount {
+    unsigned long mallocs;
+    unsigned long frees;
+    unsigned long reallocs;
+    struct opcount *next;
+} opcount_t;
+
+#ifdef MM_THREADSAFE
+static __thread opcount_t* my_ops = NULL;  // this thread's counters
+static opcount_t* all_ops = NULL;          // every live thread's counters
+static opcount_t  retired_ops;             // totals of exited threads
+static pthread_mutex_t ops_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ops_key;
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+static void ops_init(void);
+static void ops_retire(void*);
+static opcount_t* thread_ops(void);
+#define OPS()				(my_ops ? my_ops : thread_ops())
+#else
+static opcount_t  the_ops;
+#define OPS()				(&the_ops)
+#endif
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -40,11 +95,12 @@ team_t team = {
 #define WSIZE			4
 #define DSIZE			8
 #define ALIGNMENT		DSIZE
-#define CHUNKSIZE		(1<<12)
+#define CHUNKSIZE		(1<<12)		// default of mm_ctl "grow.chunk"
 #define MINBLK			(2*DSIZE)
 
-/* MAX helper macro */
+/* MAX and MIN helper macros */
 #define MAX(x, y)		((x) > (y) ? (x) : (y))
+#define MIN(x, y)		((x) < (y) ? (x) : (y))
 
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(size)			(((size) + (ALIGNMENT-1)) & ~0x7)
@@ -60,6 +116,13 @@ team_t team = {
 #define GET_SIZE(p)			(GET(p) & ~0x7)
 #define IS_ALLOC(p)			(GET(p) & 0x1)
 
+/* Allocated blocks picked by the heap profiler carry this bit in both tags */
+#define SAMPLED				0x2
+#define IS_SAMPLED(p)		(GET(p) & SAMPLED)
+
+/* Free blocks whose pages the background thread returned carry this bit in both tags */
+#define PURGED				0x4
+
 /* Given a block ptr bp, compute address of its header and footer */
 #define HEADER(bp)			((char *)(bp) - WSIZE)
 #define FOOTER(bp)			((char *)(bp) + GET_SIZE(HEADER(bp)) - ALIGNMENT)
@@ -74,254 +137,2958 @@ team_t team = {
 
 #define SET_PTR(bp, val)	(bp = val)
 
-// Global Variable for start of heap.
-void* freelist_head = NULL;
+/*
+ * Software prefetch. Free list walks and unlinks jump to blocks all over
+ * the heap, so start loading the next one while the current one is still
+ * being looked at. PREFETCH_LINKS fetches the list neighbours that
+ * erase(bp) is about to write. Prefetching an invalid address is harmless.
+ * Off unless built with MM_PREFETCH, until it has been measured on the
+ * -m32 build (see the README).
+ */
+#ifdef MM_PREFETCH
+#define PREFETCH(p)			__builtin_prefetch(p)
+#define PREFETCH_LINKS(bp)	(__builtin_prefetch(PREV_PTR(bp), 1), __builtin_prefetch(NEXT_PTR(bp), 1))
+#else
+#define PREFETCH(p)
+#define PREFETCH_LINKS(bp)
+#endif
+
+// Self-checking level set by mm_set_check (MM_CHECK_*).
+static int check_level = MM_CHECK_OFF;
+
+// Heap profiler countdown: bytes left to allocate before the next sample.
+static int64_t prof_left = INT64_MAX;
+static size_t prof_rate;    // its mean sample interval, see the profiler below
+
+/*
+ * Allocator policies. The core functions take a mask of these and are
+ * always inlined, so each engine below is compiled with its policy
+ * folded in as a constant and pays nothing for the choice at run time.
+ */
+#define FIT_BEST			0x1		// best fit (default: first fit)
+#define ORDER_ADDR			0x2		// address-ordered free lists (default: LIFO)
+#define MERGE_DEFER			0x4		// coalesce only when a fit fails (default: on free)
+#define GROW_EXACT			0x8		// grow the heap by the request (default: CHUNKSIZE)
+#define GROW_ADAPT			0x10	// grow by an adaptive step, see grow_heap
+
+/* Tuning of GROW_ADAPT, in mallocs between two heap extensions */
+#define GROW_MAX			(1<<20)	// largest step
+#define GROW_SHARE			16		// and at most 1/GROW_SHARE of the heap
+#define GROW_BURST			64		// closer than this: double the step
+#define GROW_STABLE			4096	// every this many without one: halve it
+
+/*
+ * Knobs that were compile-time constants (mm_ctl "grow.chunk" and
+ * "split.min"): the least the heap grows by, and the least a block has
+ * to be bigger than a request for split to cut the rest off.
+ */
+static size_t grow_chunk = CHUNKSIZE;
+static size_t split_min = MINBLK;
+
+#define CORE				static inline __attribute__((always_inline))
+
+// An engine is the core compiled for one policy mask.
+typedef struct {
+    const char* name;
+    int policy;
+    void* (*malloc_block)(size_t);
+    void* (*free_block)(void*);
+    void* (*realloc_block)(void*, size_t);
+} engine_t;
+
+// The index of the engine that mm_init and mm_heap_create set heaps up with.
+static int engine_index = 0;
+
+/*
+ * A heap: its free lists, engine, byte counts and growth state, on a
+ * memlib region of its own. main_heap is the one mm_init sets up and
+ * mm_malloc allocates from; the ones mm_heap_create makes are linked
+ * in after it. The core works on heap, which is main_heap except while
+ * an mm_heap_* call or a free routed by address is using another one.
+ */
+struct mm_heap {
+    // Segregated free lists, one per size class (see sizeclass.h). Every list
+    // ends at the same sentinel, the prologue, whose header reads allocated.
+    void* freelist_head[SC_NLISTS];
+    void* heap_listp;
+
+    // Bit c is set while list c is not empty, so a fit skips empty lists in one go
+    uint64_t list_map[BITMAP_WORDS(SC_NLISTS)];
+
+    // The engine, fixed when the heap is set up
+    const engine_t* engine;
+
+    // Byte counts for mm_stats, kept up to date as blocks change state.
+    // insert and erase keep the free ones, so mm_stats needn't walk the lists.
+    size_t heap_bytes;
+    size_t alloc_bytes;
+    size_t free_bytes;
+    size_t free_blocks;
+
+    // Frees not yet coalesced by a MERGE_DEFER engine.
+    size_t deferred_frees;
+
+    // GROW_ADAPT state: the current step, a malloc clock and its value at the last extension.
+    size_t grow_step;
+    unsigned long grow_clock;
+    unsigned long grow_last;
+
+    // heap_bytes as of the background thread's last pass, and the passes
+    // since it last grew
+    size_t bg_bytes;
+    size_t bg_idle;
+
+    // Where the pass stopped in free list bg_list, NULL if at no block
+    void* bg_next;
+    int bg_list;
+
+    mem_region_t* region;       // NULL for memlib's default region
+    int thread;                 // THREAD_* if a thread's small-object heap
+    struct mm_heap* next;
+};
+
+static mm_heap_t  main_heap;
+static mm_heap_t* heap = &main_heap;
+
+#define FOR_EACH_HEAP(h)	for (h = &main_heap; h != NULL; h = h->next)
+
+/*
+ * Address space reserved for each heap besides main_heap, which has
+ * memlib's MAX_HEAP. A 32-bit process fits only about three MAX_HEAP
+ * ranges, so the others get less: a thread's small-block heap least.
+ */
+#define HEAP_RESERVE		((size_t)1 << (sizeof(void *) == 4 ? 26 : 34))
+#define THREAD_RESERVE		((size_t)1 << (sizeof(void *) == 4 ? 24 : 30))
+
+/*
+ * The reserved range of every heap but main_heap, sorted by address, so
+ * heap_of finds a block's heap by binary search rather than asking each
+ * heap's region in turn. Kept under the lock by create_heap and
+ * destroy_heap; the array comes from libc, like the heap descriptors.
+ */
+typedef struct {
+    char* lo;
+    char* hi;
+    mm_heap_t* heap;
+} heap_range_t;
+
+static heap_range_t* heap_map = NULL;
+static int heap_map_len = 0;
+static int heap_map_cap = 0;
+
+/*
+ * NUMA mode (mm_set_numa). mm_init gives every node an arena, a heap whose
+ * region memlib binds to that node, with main_heap the arena of node 0,
+ * and mm_malloc allocates from the arena of the node the thread runs on.
+ * Nodes and their CPUs come from sysfs; a single-node machine gets the
+ * one arena, which is the plain allocator. The arenas are made once and
+ * kept: later mm_inits only empty them, until NUMA mode is turned off.
+ */
+#ifndef NUMA_SYSFS
+#define NUMA_SYSFS			"/sys/devices/system/node"
+#endif
+#define NUMA_MAX_NODES		64
+#define NUMA_MAX_CPUS		1024
+
+static int numa_on = 0;                         // set by mm_set_numa for mm_init
+static int numa_nodes = 0;                      // arenas in use, 0 or 1 = not NUMA
+static void* numa_bound = NULL;                 // default region bound to node 0
+static mm_heap_t* numa_arena[NUMA_MAX_NODES];
+static unsigned char cpu_node[NUMA_MAX_CPUS];   // filled in by numa_detect
+
+#define ARENA()				numa_arena[cpu_node[(unsigned int)sched_getcpu() % NUMA_MAX_CPUS]]
+
+/*
+ * Placement (mm_set_placement). Under MM_PLACE_THREAD every thread takes
+ * its small blocks (up to SC_MAX_SMALL) from a heap of its own, so small
+ * objects of different threads never share a cache line or even a page.
+ * A thread gets its heap at its first small malloc; when it exits the
+ * heap, with whatever is still allocated in it, passes to the next new
+ * thread. mm_init drops them all, which place_gen tells the threads.
+ */
+#define THREAD_OWNED		1
+#define THREAD_IDLE			2
+
+static int placement = MM_PLACE_SHARED;
+static unsigned long place_gen = 1;
+static __thread mm_heap_t* my_heap = NULL;
+static __thread unsigned long my_gen = 0;
+#ifdef MM_THREADSAFE
+static pthread_key_t place_key;
+static pthread_once_t place_once = PTHREAD_ONCE_INIT;
+static void place_init(void);
+static void place_retire(void*);
+#endif
+
+// Does mm_malloc pick between heaps at all (placement or NUMA)?
+static int steer = 0;
+
+/*
+ * Small-block caches (mm_set_cache), in front of the lock. A cache holds
+ * a stack of free blocks for every size class up to CACHE_MAX, linked
+ * through their payloads: word 0 points to the next block, word 1 is the
+ * depth of the stack from this block down. The blocks stay allocated as
+ * far as the heap is concerned. A malloc that misses asks the heap for
+ * a block of the full class size, so whatever comes back on free fits
+ * any request of its class. A class holds up to cache_bytes worth of
+ * blocks (CACHE_BYTES unless set with mm_ctl), and at least
+ * CACHE_MIN_DEPTH.
+ *
+ * Per-CPU caches are pushed and popped in rseq critical sections: the
+ * kernel restarts a section from the top if the thread is preempted or
+ * migrated before its final store, so a CPU's cache only ever changes
+ * under one thread at a time and needs neither the lock nor atomics.
+ * Per-thread caches are plain stacks, flushed back to the heap when the
+ * thread exits. mm_init empties them all (cache_gen tells the threads).
+ *
+ * The sections are x86-64 only. There is no i386 version: one was
+ * written but never run, so the -m32 build falls back to per-thread
+ * caches.
+ */
+#if defined(MM_THREADSAFE) && !defined(MM_DEBUG)
+#define MM_CACHE
+#endif
+#if defined(MM_CACHE) && defined(__linux__) && defined(__x86_64__) && \
+    defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define MM_RSEQ
+#include <sys/rseq.h>
+#endif
+
+#define CACHE_MAX			512		// largest cached block
+#define CACHE_BYTES			2048	// most bytes cached per class
+#define CACHE_MIN_DEPTH		4
+#define CACHE_SLOTS			32		// > the class of CACHE_MAX, a power of two
+
+// One cache; a power of two in size so per-CPU ones are a shift apart
+typedef struct {
+    void* head[CACHE_SLOTS];
+} cache_t;
+
+#define CACHE_SHIFT			(sizeof(void *) == 8 ? 8 : 7)
+
+static int cache_want = MM_CACHE_OFF;           // set by mm_set_cache for mm_init
+static int cache_on = MM_CACHE_OFF;             // the mode in effect
+static size_t cache_bytes = CACHE_BYTES;
+#ifdef MM_CACHE
+static unsigned long cache_gen = 1;
+static uintptr_t cache_depth[CACHE_SLOTS];      // most blocks per class
+static __thread cache_t* my_cache = NULL;
+static __thread unsigned long my_cache_gen = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static void cache_setup(void);
+static void cache_size(void);
+static inline int cache_class(size_t);
+static inline void* cache_pop(int);
+static inline int cache_push(void*, int);
+static cache_t* thread_cache(void);
+static void cache_init(void);
+static void cache_retire(void*);
+#endif
+#ifdef MM_RSEQ
+static cache_t* cpu_cache = NULL;
+static unsigned int cache_ncpus = 0;
+#define RSEQ()				((struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset))
+static inline void* rseq_pop(struct rseq*, void**);
+static inline int rseq_push(struct rseq*, void**, void*, uintptr_t);
+#endif
+
+/*
+ * The background thread (mm_ctl "bg.*"). A pass first frees part of
+ * every per-CPU cache, outside the lock, then goes over the heaps: it
+ * returns the pages inside free blocks of at least bg_purge bytes and
+ * marks them PURGED so the next pass skips them, and if the heap grew
+ * since the last pass faults in as much again (up to bg_ahead) above
+ * its top. Once it has gone bg_trim passes without growing, it returns
+ * what is committed up there, so memory faulted in ahead of a heap that
+ * pauses between bursts is not thrown away on the very next pass.
+ * mm_init stops the thread while it runs.
+ *
+ * The lock is taken for at most BG_VISIT blocks of one free list at a
+ * time, PURGED ones included, so a malloc never waits behind a whole
+ * pass. A longer list is picked up again at the block the last stretch
+ * stopped at, which erase forgets if it unlinks that block meanwhile.
+ */
+#define BG_BATCH			64		// cached blocks freed per lock taken
+#define BG_VISIT			256		// free blocks looked at per lock taken
+
+static size_t bg_on = 0;
+static size_t bg_interval = 100;
+static size_t bg_purge = 64*1024;
+static size_t bg_ahead = 1<<20;
+static size_t bg_trim = 10;
+static size_t bg_decay = 50;
+static size_t bg_passes = 0;
+static size_t bg_purged = 0;
+#ifdef MM_THREADSAFE
+static pthread_t bg_thread;
+static int bg_stop = 0;
+static pthread_mutex_t bg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bg_wake = PTHREAD_COND_INITIALIZER;
+static void* bg_main(void*);
+#endif
+static int   bg_enable(size_t);
+static int   bg_run(size_t);
+static void  bg_pass(int);
+static int   bg_heap(int);
+#ifdef MM_RSEQ
+static void  cache_decay(void);
+#endif
+
+/*
+ * The knobs of mm_ctl. A knob is a size_t variable, or a pair of get
+ * and set functions for state kept some other way; a set function also
+ * replaces the plain store where setting a knob has to do more.
+ */
+#define CTL_RO				0x1		// read only
+#define CTL_WO				0x2		// write only
+#define CTL_ALIGN			0x4		// round values up to ALIGNMENT
+
+typedef struct {
+    const char* name;
+    size_t* var;
+    size_t min, max;
+    int flags;
+    size_t (*get)(void);    // if var is NULL
+    int (*set)(size_t);
+} ctl_t;
+
+static size_t engine_get(void);
+static int    engine_set(size_t);
+static size_t cache_mode_get(void);
+static int    cache_mode_set(size_t);
+static int    cache_bytes_set(size_t);
+
+static const ctl_t ctls[] = {
+    {"grow.chunk",  &grow_chunk,  MINBLK, 1<<30,   CTL_ALIGN, NULL, NULL},
+    {"split.min",   &split_min,   MINBLK, 1<<30,   CTL_ALIGN, NULL, NULL},
+    {"engine",      NULL,         0, (size_t)-1,   0,      engine_get, engine_set},
+    {"cache.mode",  NULL,         0, MM_CACHE_CPU, 0,      cache_mode_get, cache_mode_set},
+    {"cache.bytes", &cache_bytes, 0, 1<<20,        0,      NULL, cache_bytes_set},
+    {"bg.enable",   &bg_on,       0, 1,            0,      NULL, bg_enable},
+    {"bg.interval", &bg_interval, 1, 3600000,      0,      NULL, NULL},
+    {"bg.run",      NULL,         0, (size_t)-1,   CTL_WO, NULL, bg_run},
+    {"bg.purge",    &bg_purge,    0, (size_t)-1,   0,      NULL, NULL},
+    {"bg.ahead",    &bg_ahead,    0, (size_t)-1,   0,      NULL, NULL},
+    {"bg.trim",     &bg_trim,     0, (size_t)-1,   0,      NULL, NULL},
+    {"bg.decay",    &bg_decay,    0, 100,          0,      NULL, NULL},
+    {"bg.passes",   &bg_passes,   0, 0,            CTL_RO, NULL, NULL},
+    {"bg.purged",   &bg_purged,   0, 0,            CTL_RO, NULL, NULL},
+};
+#define NCTLS				(int)(sizeof(ctls) / sizeof(ctls[0]))
 
-void* heap_listp = NULL;
+// Set once MM_OPTIONS has been applied, by mm_ctl_env or the first mm_init
+static int ctl_env_read = 0;
 
 // Helper Functions:
-static void* extend_heap(size_t);
-static void* coalesce(void*);
-static void* find_fit(size_t);
-static void  split(void*, size_t);
-static void* push_front(void*);
+CORE  void* malloc_block(size_t, int);
+CORE  void* free_block(void*, int);
+CORE  void* realloc_block(void*, size_t, int);
+CORE  void* extend_heap(size_t, int);
+CORE  void* grow_heap(size_t, int);
+CORE  void* coalesce(void*, int);
+CORE  void  coalesce_all(int);
+CORE  void* find_fit(size_t, int);
+CORE  void  split(void*, size_t, int);
+CORE  void* insert(void*, int);
 static void  erase(void*);
+static inline int list_of(size_t);
+static void  select_engine(void);
+static int   init_heap(void);
+static void  use_heap(mm_heap_t*);
+static mm_heap_t* heap_of(void*);
+static mm_heap_t* create_heap(int, size_t);
+static void  destroy_heap(mm_heap_t*);
+static int   reset_heap(mm_heap_t*);
+static int   map_heap(mm_heap_t*);
+static void  unmap_heap(mm_heap_t*);
+static void  numa_setup(void);
+static void  numa_drop(int);
+static int   numa_detect(void);
+static inline mm_heap_t* pick_heap(size_t);
+static mm_heap_t* thread_heap(void);
+static void  drop_thread_heaps(void);
+#ifndef MM_DEBUG
+static void* hot_block(size_t);
+#endif
+#ifdef MM_DEBUG
+static void* debug_malloc(size_t);
+static void* debug_free(void*);
+static void* debug_realloc(void*, size_t);
+static void  debug_reset(mm_heap_t*);
+#define MALLOC_BLOCK		debug_malloc
+#define FREE_BLOCK			debug_free
+#define REALLOC_BLOCK		debug_realloc
+#define HOT_BLOCK			debug_malloc	// canaries first, no line alignment
+#else
+#define MALLOC_BLOCK		heap->engine->malloc_block
+#define FREE_BLOCK			heap->engine->free_block
+#define REALLOC_BLOCK		heap->engine->realloc_block
+#define HOT_BLOCK			hot_block
+#endif
+static void  prof_sample(void*, size_t);
+static struct prof_stack* prof_forget(void*, size_t*);
+static void  prof_relink(void*, struct prof_stack*, size_t);
+static void  prof_reset(mm_heap_t*);
+static int   check_heap(int);
+static int   check_block(void*, int);
+static int   check_neighbours(void*, int);
+static void  check_op(void*);
 
 /* 
- * mm_init - initialize the malloc package. Create a prologue block for the beginning
- *           of the list, and point the freelist head at the epilogue head. Then extend the heap
- *           to allocate the minimum block (4 words)
+ * mm_init - initialize the malloc package: set main_heap up afresh on
+ *           memlib's default region, and in NUMA mode the other nodes'
+ *           arenas too. Threads' heaps go; heaps from mm_heap_create live on.
  */
 int mm_init(void) {
+    int ret, bg;
 
-    if ((heap_listp = mem_sbrk(8*WSIZE)) == (void *)-1)
+    mm_ctl_env();
+    if ((bg = (int)bg_on))
+        bg_enable(0);
+    LOCK();
+    if (!numa_on)
+        numa_drop(0);
+    drop_thread_heaps();
+#ifdef MM_DEBUG
+    debug_reset(&main_heap);
+#endif
+    prof_reset(&main_heap);
+    if (numa_on)
+        numa_setup();
+    steer = (placement == MM_PLACE_THREAD) || numa_nodes > 1;
+    ret = init_heap();
+#ifdef MM_CACHE
+    cache_setup();
+#endif
+    UNLOCK();
+    if (bg)
+        bg_enable(1);
+    return ret;
+}
+
+/*
+ * init_heap - Create a prologue block for the beginning of the list, and point
+ *           every freelist head at the prologue. Then extend the heap to
+ *           allocate the minimum block (4 words)
+ */
+static int init_heap(void) {
+    int i;
+
+    if ((heap->heap_listp = mem_sbrk(8*WSIZE)) == (void *)-1)
         return -1;
 
-    SET_INT(heap_listp, 0);
-    SET_INT(heap_listp + (1*WSIZE), PACK(DSIZE, 1));    //Prologue Header
-    SET_INT(heap_listp + (2*WSIZE), PACK(DSIZE, 1));    //Prologue Footer
-    SET_INT(heap_listp + (3*WSIZE), PACK(0, 1));        //Epilogue Header
+    SET_INT(heap->heap_listp, 0);
+    SET_INT(heap->heap_listp + (1*WSIZE), PACK(DSIZE, 1));    //Prologue Header
+    SET_INT(heap->heap_listp + (2*WSIZE), PACK(DSIZE, 1));    //Prologue Footer
+    SET_INT(heap->heap_listp + (3*WSIZE), PACK(0, 1));        //Epilogue Header
 
-    freelist_head = heap_listp + (2*WSIZE);
+    for (i = 0; i < SC_NLISTS; i++)
+        heap->freelist_head[i] = heap->heap_listp + (2*WSIZE);
+    memset(heap->list_map, 0, sizeof(heap->list_map));
+    heap->heap_bytes = 8*WSIZE;
+    heap->alloc_bytes = 0;
+    heap->free_bytes = 0;
+    heap->free_blocks = 0;
+    heap->deferred_frees = 0;
+    heap->grow_step = grow_chunk;
+    heap->grow_clock = heap->grow_last = 0;
+    heap->bg_bytes = 0;
+    heap->bg_idle = 0;
+    heap->bg_next = NULL;
+    select_engine();
 
-    if (extend_heap(4) == NULL)
+    // The first free block is alone on its list, so any insertion order does
+    if (extend_heap(4, 0) == NULL)
         return -1;
     return 0;
 }
 
-
-/* 
- * mm_malloc - Adjust the size to be aligned. Then check for a fit in the free list. If one is found, split() with our adjusted size.
- *             If no fit is found, extend the heap by the max of the adjusted size and chunksize, then split()
+/*
+ * mm_malloc, mm_free, mm_realloc - Public entry points. They only take the
+ *           lock (if any) and hand off to the *_block workers, which is what
+ *           the allocator calls internally so realloc never re-enters the lock.
+ *           The debug build goes through the debug_* layer first. With
+ *           profiling off prof_left never runs out, so all it costs is the
+ *           countdown and the SAMPLED bit test on free. Once there are
+ *           other heaps, free and realloc first switch to the block's own.
+ *           Small-block caches come before the lock; they only take
+ *           main_heap's blocks, so only while it is the one heap.
  */
 void *mm_malloc(size_t size) {
-    size_t adjustedSize, extendSize;
-    char* ptr;
-
-    // Ignore bad requests.
-    if (size == 0)
-        return NULL;
+    void* ptr;
+#ifdef MM_CACHE
+    int c;
+#endif
 
-    // Adjust the block size to incluse header/footer + alignment.
-    if (size <= DSIZE) {
-        adjustedSize = 2*DSIZE;
-    } else {
-        adjustedSize = DSIZE * ((size + (DSIZE) + (DSIZE - 1))/ DSIZE);
+    OPS()->mallocs++;
+#ifdef MM_CACHE
+    if (cache_on && size - 1 < CACHE_MAX - DSIZE && !check_level && !prof_rate) {
+        c = cache_class(size);
+        if ((ptr = cache_pop(c)) != NULL)
+            return ptr;
+        size = sc_size[c] - DSIZE;      // fit for any request of the class
     }
+#endif
+    LOCK();
+    if (steer)
+        use_heap(pick_heap(size));
+    ptr = MALLOC_BLOCK(size);
+    if ((prof_left -= size) < 0 && ptr != NULL)
+        prof_sample(ptr, size);
+    if (check_level)
+        check_op(ptr);
+    if (heap != &main_heap)
+        use_heap(&main_heap);
+    UNLOCK();
+    return ptr;
+}
 
-    // Search the free list for a fit
-    if ((ptr = find_fit(adjustedSize)) != NULL) {
-        split(ptr, adjustedSize);
-        return ptr;
-    }
+void mm_free(void *ptr) {
+    OPS()->frees++;
+#ifdef MM_CACHE
+    if (cache_on && main_heap.next == NULL && !check_level && !IS_SAMPLED(HEADER(ptr)) &&
+        GET_SIZE(HEADER(ptr)) <= CACHE_MAX && cache_push(ptr, list_of(GET_SIZE(HEADER(ptr)))))
+        return;
+#endif
+    LOCK();
+    if (main_heap.next != NULL)
+        use_heap(heap_of(ptr));
+    if (IS_SAMPLED(HEADER(ptr)))
+        prof_forget(ptr, NULL);
+    ptr = FREE_BLOCK(ptr);
+    if (check_level)
+        check_op(ptr);
+    if (heap != &main_heap)
+        use_heap(&main_heap);
+    UNLOCK();
+}
 
-    // No fit found. Get more memory and place the block.
-    extendSize = MAX(adjustedSize, CHUNKSIZE);
-    if ((ptr = extend_heap(extendSize/WSIZE)) == NULL)
-        return NULL;
-    split(ptr, adjustedSize);
-    return ptr;
+void *mm_realloc(void *ptr, size_t size) {
+    struct prof_stack* st = NULL;
+    size_t sampled;
+    void* new_ptr;
 
+    OPS()->reallocs++;
+    LOCK();
+    if (main_heap.next != NULL)
+        use_heap(heap_of(ptr));
+    if (IS_SAMPLED(HEADER(ptr)))
+        st = prof_forget(ptr, &sampled);
+    new_ptr = REALLOC_BLOCK(ptr, size);
+    // A failed realloc leaves ptr live, so it keeps its sample
+    if (new_ptr == NULL && size > 0 && st != NULL)
+        prof_relink(ptr, st, sampled);
+    if (size > 0 && (prof_left -= size) < 0 && new_ptr != NULL)
+        prof_sample(new_ptr, size);
+    if (check_level && size > 0)
+        check_op(new_ptr);
+    if (heap != &main_heap)
+        use_heap(&main_heap);
+    UNLOCK();
+    return new_ptr;
 }
 
 /*
- * mm_free - Set the HEADER and FOOTER tags to the size currently allocated, then coalesce()
+ * mm_calloc - mm_malloc of nmemb * size bytes, zeroed outside the lock.
+ *           NULL if the product overflows.
  */
-void mm_free(void *ptr) {
-    size_t size = GET_SIZE(HEADER(ptr));
+void *mm_calloc(size_t nmemb, size_t size) {
+    void* ptr;
 
-    SET_INT(HEADER(ptr), PACK(size, 0));
-    SET_INT(FOOTER(ptr), PACK(size, 0));
-    coalesce(ptr);
+    if (size != 0 && nmemb > (size_t)-1 / size)
+        return NULL;
+    if ((ptr = mm_malloc(nmemb * size)) != NULL)
+        memops_zero(ptr, nmemb * size);
+    return ptr;
 }
 
 /*
- * mm_realloc - Realloc will fall into these cases:
- *					- Bad request | size is 0 so free the block
- 					- The size requested is smaller than the current block so do no work
- 					- The size requested is larger than the current allocated block:
- 						- The next block could be free and have enough space to fit the 
- 							new request when combined with the current block. Check and
- 							combine if possible.
- 						- Otherwise allocate a new block and then copy the user data over,
- 							freeing the original block.
+ * mm_malloc_hot - mm_malloc for an object that is written often: it starts
+ *           on a cache line and has its lines to itself.
  */
-void *mm_realloc(void *ptr, size_t size) {
-    if (size <= 0) {
-        mm_free(ptr);
-        return ptr;
-    } else if (size + 2*DSIZE <= GET_SIZE(HEADER(ptr))) {
-        return ptr;
-    } else {
-        
-        int next_block_available = IS_ALLOC(HEADER(NEXT_BLK(ptr)));
-        int current_size = GET_SIZE(HEADER(ptr));
-        int next_size = GET_SIZE(HEADER(NEXT_BLK(ptr)));
-
-        if (!next_block_available && (next_size + current_size > size + DSIZE)) {
-            erase(NEXT_BLK(ptr));
-            SET_INT(HEADER(ptr), PACK(next_size + current_size, 1));
-            SET_INT(FOOTER(ptr), PACK(next_size + current_size, 1));
-            return ptr;
-        }
-        
+void *mm_malloc_hot(size_t size) {
+    void* ptr;
 
-        void* new_ptr = mm_malloc(size);
-        memcpy(new_ptr, ptr, size);
-        mm_free(ptr);
-        return new_ptr;
-        
-    }
+    OPS()->mallocs++;
+    LOCK();
+    if (steer)
+        use_heap(pick_heap(size));
+    ptr = HOT_BLOCK(size);
+    if ((prof_left -= size) < 0 && ptr != NULL)
+        prof_sample(ptr, size);
+    if (check_level)
+        check_op(ptr);
+    if (heap != &main_heap)
+        use_heap(&main_heap);
+    UNLOCK();
+    return ptr;
 }
-        
-    
 
-
-/* 
- * extend_heap - Extend the heap with an even number of blocks. Set the HEADER and FOOTER pointers
- *               to be this new size, and the NEXT_BLK to be empty. Then coalesce().
+#ifndef MM_DEBUG
+/*
+ * hot_block - Round the payload up to whole cache lines and carve it, line
+ *           aligned, out of a block big enough for any misalignment. The
+ *           slack on either side goes back to the free lists. The footer
+ *           and the next block's header follow the last line:
+ *
+ *     | ... hdr | line | ... | line | ftr | hdr ...
+ *               ^ MM_CACHELINE aligned
  */
-static void* extend_heap(size_t words) {
+static void* hot_block(size_t size) {
+    size_t lines = (size + MM_CACHELINE - 1) & ~(size_t)(MM_CACHELINE - 1);
+    size_t want = lines + DSIZE, have, gap;
     char* bp;
-    size_t size;
+    char* hot;
 
-    // Alocate an even number of blocks to maintain double word alignment
-    size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-    if ((long)(bp = mem_sbrk(size)) == -1)
+    if (size == 0)
+        return NULL;
+    if ((bp = heap->engine->malloc_block(lines + MM_CACHELINE + MINBLK)) == NULL)
         return NULL;
+    have = GET_SIZE(HEADER(bp));
+    hot = (char *)(((uintptr_t)bp + MM_CACHELINE - 1) & ~(uintptr_t)(MM_CACHELINE - 1));
+    if (hot != bp && hot - bp < MINBLK)
+        hot += MM_CACHELINE;
 
-    /* Initialize the free block header/footer and the epilogue block */
-    SET_INT(HEADER(bp), PACK(size, 0));             // Free block header
-    SET_INT(FOOTER(bp), PACK(size, 0));             // Free block footer
-    SET_INT(HEADER(NEXT_BLK(bp)), PACK(0, 1));      // New Epilogue Header
+    // Free the gap in front, then whatever is left past want
+    if ((gap = hot - bp) != 0) {
+        SET_INT(HEADER(hot), PACK(have - gap, 1));
+        SET_INT(FOOTER(hot), PACK(have - gap, 1));
+        SET_INT(HEADER(bp), PACK(gap, 1));
+        SET_INT(FOOTER(bp), PACK(gap, 1));
+        heap->engine->free_block(bp);
+        have -= gap;
+    }
+    if (have - want >= MINBLK) {
+        SET_INT(HEADER(hot), PACK(want, 1));
+        SET_INT(FOOTER(hot), PACK(want, 1));
+        bp = NEXT_BLK(hot);
+        SET_INT(HEADER(bp), PACK(have - want, 1));
+        SET_INT(FOOTER(bp), PACK(have - want, 1));
+        heap->engine->free_block(bp);
+    }
+    return hot;
+}
+#endif
 
-    // Coalesce if the previous block was free
-    return coalesce(bp);
+/*
+ * mm_heap_create - Set up a new heap on a memlib region of its own, with
+ *           the engine mm_init would pick. NULL if memlib can't reserve one.
+ */
+mm_heap_t *mm_heap_create(void) {
+    mm_heap_t* h;
+
+    LOCK();
+    h = create_heap(-1, HEAP_RESERVE);
+    UNLOCK();
+    return h;
 }
 
-/* 
- * coalesce - Merge free blocks to prevent too small of free blocks. Erase the NEXT_BLK, PREV_BLK, both,
- *            or neither, depending on if they're allocated. Then, merge the consecutive free blocks and push_front()
+/*
+ * mm_heap_malloc - mm_malloc from heap h (NULL = the main heap)
  */
-static void* coalesce(void* ptr) {
-    
-    size_t prev_alloc = IS_ALLOC(FOOTER(PREV_BLK(ptr))) || PREV_BLK(ptr) == ptr;
-    size_t next_alloc = IS_ALLOC(HEADER(NEXT_BLK(ptr)));
-    size_t size = GET_SIZE(HEADER(ptr));
+void *mm_heap_malloc(mm_heap_t *h, size_t size) {
+    void* ptr;
 
-    if (prev_alloc && next_alloc) {				// Souronding blocks are allocated
-    	// Do nothing
+    OPS()->mallocs++;
+    LOCK();
+    if (h != NULL)
+        use_heap(h);
+    ptr = MALLOC_BLOCK(size);
+    if ((prof_left -= size) < 0 && ptr != NULL)
+        prof_sample(ptr, size);
+    if (check_level)
+        check_op(ptr);
+    use_heap(&main_heap);
+    UNLOCK();
+    return ptr;
+}
 
-    } else if (prev_alloc && !next_alloc) {		// Next block is free
-        size += GET_SIZE(HEADER(NEXT_BLK(ptr)));
-        erase(NEXT_BLK(ptr));
-        SET_INT(HEADER(ptr), PACK(size, 0));
-        SET_INT(FOOTER(ptr), PACK(size, 0));
+/*
+ * mm_heap_destroy - Release heap h and every block in it at once
+ */
+void mm_heap_destroy(mm_heap_t *h) {
+    if (h == NULL)
+        return;
+    LOCK();
+    destroy_heap(h);
+    UNLOCK();
+}
 
-    } else if (!prev_alloc && next_alloc) {		// Previous block is free
-        size += GET_SIZE(HEADER(PREV_BLK(ptr)));
-        ptr = PREV_BLK(ptr);
-        erase(ptr);
-        SET_INT(HEADER(ptr), PACK(size, 0));
-        SET_INT(FOOTER(ptr), PACK(size, 0));
+/*
+ * mm_heap_reset - Empty heap h, keeping its region, as mm_init does for
+ *           the main heap
+ */
+int mm_heap_reset(mm_heap_t *h) {
+    int ret;
 
-    } else {									// Both next & prev block are free
-        size += GET_SIZE(HEADER(PREV_BLK(ptr))) + GET_SIZE(HEADER(NEXT_BLK(ptr)));
-        erase(NEXT_BLK(ptr));
-        erase(PREV_BLK(ptr));
-        ptr = PREV_BLK(ptr);
+    LOCK();
+    ret = reset_heap(h);
+    UNLOCK();
+    return ret;
+}
 
-        SET_INT(HEADER(ptr), PACK(size, 0));
-        SET_INT(FOOTER(ptr), PACK(size, 0));
-        
-    }
+/*
+ * create_heap - mm_heap_create with the lock held, reserving bytes for
+ *           the region. The region is bound to NUMA node node first,
+ *           unless node is -1.
+ */
+static mm_heap_t* create_heap(int node, size_t bytes) {
+    mm_heap_t* h;
 
-    return push_front(ptr);
+    // The heap descriptor comes from libc, like the op counters
+    if ((h = calloc(1, sizeof(mm_heap_t))) == NULL)
+        return NULL;
+    if ((h->region = mem_region_create(bytes)) == NULL) {
+        free(h);
+        return NULL;
+    }
+    if (node >= 0)
+        mem_region_bind(h->region, node);
+    use_heap(h);
+    if (init_heap() < 0 || map_heap(h) < 0) {
+        use_heap(&main_heap);
+        mem_region_destroy(h->region);
+        free(h);
+        return NULL;
+    }
+    use_heap(&main_heap);
+    h->next = main_heap.next;
+    main_heap.next = h;
+    return h;
 }
 
-/* 
- * find_fit - Find a fit for a chunk of aSize by iterating through the free list. 
- *            Implemented with first fit.
+/*
+ * destroy_heap - mm_heap_destroy with the lock held
  */
-static void* find_fit(size_t aSize) {
-    void* ptr = NULL;
+static void destroy_heap(mm_heap_t* h) {
+    mm_heap_t** pp;
 
-    for (ptr = freelist_head; IS_ALLOC(HEADER(ptr)) == 0; ptr = NEXT_PTR(ptr)) {
-        if (GET_SIZE(HEADER(ptr)) >= aSize) {
-            return ptr;
+#ifdef MM_DEBUG
+    debug_reset(h);
+#endif
+    prof_reset(h);
+    for (pp = &main_heap.next; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == h) {
+            *pp = h->next;
+            break;
         }
     }
-    return NULL;
+    unmap_heap(h);
+    mem_region_destroy(h->region);
+    free(h);
 }
 
-/* 
- *split - Places the new segment into the free block. Will slice
- *        if there is extra space at the end by setting the tags
- *        and calling coalesce().
+/*
+ * reset_heap - mm_heap_reset with the lock held: drop every block of h
+ *           and set it up again at the bottom of its region, whose pages
+ *           stay mapped and committed.
  */
-static void split(void* ptr, size_t neededSize) {
-    
-    size_t blockSize = GET_SIZE(HEADER(ptr));   
+static int reset_heap(mm_heap_t* h) {
+    int ret;
 
-    if ((blockSize - neededSize) >= MINBLK) { 
-        SET_INT(HEADER(ptr), PACK(neededSize, 1));
-        SET_INT(FOOTER(ptr), PACK(neededSize, 1));
-        erase(ptr);
-        ptr = NEXT_BLK(ptr);
-        SET_INT(HEADER(ptr), PACK(blockSize-neededSize, 0));
-        SET_INT(FOOTER(ptr), PACK(blockSize-neededSize, 0));
-        coalesce(ptr);
+#ifdef MM_DEBUG
+    debug_reset(h);
+#endif
+    prof_reset(h);
+    use_heap(h);
+    mem_reset_brk();
+    ret = init_heap();
+    use_heap(&main_heap);
+    return ret;
+}
+
+/*
+ * mm_set_numa - Turn NUMA mode on or off from the next mm_init on
+ */
+void mm_set_numa(int on) {
+    LOCK();
+    numa_on = on;
+    UNLOCK();
+}
+
+/*
+ * mm_numa_nodes - How many arenas mm_init set up (1 if NUMA mode is off
+ *           or the machine has a single node)
+ */
+int mm_numa_nodes(void) {
+    return numa_nodes > 1 ? numa_nodes : 1;
+}
+
+/*
+ * numa_setup - mm_init's NUMA half. The first time, create an arena for
+ *           each node but node 0, whose arena is main_heap; if one can't be
+ *           created, the nodes from there on share main_heap. After that,
+ *           just empty the arenas, keeping their regions. The default
+ *           region is bound to node 0 whenever mem_init has made a new one.
+ */
+static void numa_setup(void) {
+    int n, i;
+
+    if (numa_nodes > 0) {
+        for (i = 1; i < numa_nodes; i++)
+            if (reset_heap(numa_arena[i]) < 0)
+                break;
+        numa_drop(i);
     } else {
-        SET_INT(HEADER(ptr), PACK(blockSize, 1));
-        SET_INT(FOOTER(ptr), PACK(blockSize, 1));
-        erase(ptr);
+        numa_arena[0] = &main_heap;
+        if ((n = numa_detect()) <= 1)
+            n = 1;
+        for (i = 1; i < n; i++)
+            if ((numa_arena[i] = create_heap(i, HEAP_RESERVE)) == NULL)
+                break;
+        for (numa_nodes = i; i < NUMA_MAX_NODES; i++)
+            numa_arena[i] = &main_heap;
+    }
+    if (numa_nodes > 1 && numa_bound != mem_heap_lo()) {
+        mem_region_bind(NULL, 0);
+        numa_bound = mem_heap_lo();
     }
 }
 
-/* 
- * push_front - Places the new segment into the freelist.
+/*
+ * numa_drop - Destroy the arenas from node keep up, whose nodes then
+ *           share main_heap (keep = 0: all of them, NUMA mode is off)
+ */
+static void numa_drop(int keep) {
+    int i;
+
+    while (numa_nodes > MAX(keep, 1))
+        destroy_heap(numa_arena[--numa_nodes]);
+    for (i = MAX(keep, 1); i < NUMA_MAX_NODES; i++)
+        numa_arena[i] = &main_heap;
+    if (keep == 0) {
+        numa_nodes = 0;
+        numa_bound = NULL;
+    }
+}
+
+/*
+ * mm_set_placement - Pick MM_PLACE_SHARED or MM_PLACE_THREAD from the next
+ *           mm_init on
+ */
+void mm_set_placement(int mode) {
+    LOCK();
+    placement = mode;
+    UNLOCK();
+}
+
+/*
+ * pick_heap - The heap mm_malloc takes a block of this size from when it
+ *           steers: the thread's own for small blocks under MM_PLACE_THREAD,
+ *           else the NUMA arena of the CPU (main_heap if NUMA mode is off).
+ */
+static inline mm_heap_t* pick_heap(size_t size) {
+    if (placement == MM_PLACE_THREAD && size <= SC_MAX_SMALL)
+        return (my_gen == place_gen) ? my_heap : thread_heap();
+    return (numa_nodes > 1) ? ARENA() : &main_heap;
+}
+
+/*
+ * thread_heap - First small malloc of this thread since mm_init: adopt the
+ *           heap of a thread that has exited, or create one.
  */
-static void* push_front(void* new_ptr) {
-	SET_PTR(NEXT_PTR(new_ptr), freelist_head);
-        SET_PTR(PREV_PTR(new_ptr), NULL);
-        SET_PTR(PREV_PTR(freelist_head), new_ptr);
+static mm_heap_t* thread_heap(void) {
+    mm_heap_t* h;
 
-	freelist_head = new_ptr;
+    FOR_EACH_HEAP(h)
+        if (h->thread == THREAD_IDLE)
+            break;
+    if (h == NULL && (h = create_heap(-1, THREAD_RESERVE)) == NULL) {
+        // Share main_heap until the next generation rather than retrying per call
+        my_heap = &main_heap;
+        my_gen = place_gen;
+        return &main_heap;
+    }
+    h->thread = THREAD_OWNED;
+    my_heap = h;
+    my_gen = place_gen;
+#ifdef MM_THREADSAFE
+    pthread_once(&place_once, place_init);
+    pthread_setspecific(place_key, h);
+#endif
+    return h;
+}
 
-	return freelist_head;
+/*
+ * drop_thread_heaps - mm_init's part: destroy every thread's heap and make
+ *           the threads ask for a new one
+ */
+static void drop_thread_heaps(void) {
+    mm_heap_t* h;
+    mm_heap_t* next;
+
+    for (h = main_heap.next; h != NULL; h = next) {
+        next = h->next;
+        if (h->thread)
+            destroy_heap(h);
+    }
+    place_gen++;
+}
+
+#ifdef MM_THREADSAFE
+/*
+ * place_init - Create the key whose destructor hands a thread's heap on
+ */
+static void place_init(void) {
+    pthread_key_create(&place_key, place_retire);
+}
+
+/*
+ * place_retire - Thread exit: its heap is up for adoption, unless mm_init
+ *           has destroyed it since.
+ */
+static void place_retire(void* arg) {
+    mm_heap_t* h;
+
+    LOCK();
+    FOR_EACH_HEAP(h)
+        if (h == arg && h->thread == THREAD_OWNED)
+            h->thread = THREAD_IDLE;
+    UNLOCK();
+}
+#endif
+
+/*
+ * mm_set_cache - Choose the small-block caches for the next mm_init (MM_CACHE_*)
+ */
+void mm_set_cache(int mode) {
+    LOCK();
+    cache_want = mode;
+    UNLOCK();
+}
+
+/*
+ * mm_cache_mode - The caches in effect since the last mm_init
+ */
+int mm_cache_mode(void) {
+    return cache_on;
+}
+
+#ifdef MM_CACHE
+/*
+ * cache_setup - mm_init's part: empty every cache and settle the mode.
+ *           Per-CPU caches need libc to have registered rseq for the
+ *           thread (glibc does from 2.35 on, unless tuned off).
+ */
+static void cache_setup(void) {
+    void* p;
+    long n;
+
+    cache_gen++;
+    cache_on = steer ? MM_CACHE_OFF : cache_want;
+    cache_size();
+    if (cache_on != MM_CACHE_CPU)
+        return;
+#ifdef MM_RSEQ
+    if (cpu_cache == NULL && __rseq_size > 0 && (int)RSEQ()->cpu_id >= 0 &&
+        (n = sysconf(_SC_NPROCESSORS_CONF)) > 0 &&
+        posix_memalign(&p, MM_CACHELINE, n * sizeof(cache_t)) == 0) {
+        cpu_cache = p;
+        cache_ncpus = n;
+    }
+    if (cpu_cache != NULL) {
+        memset(cpu_cache, 0, cache_ncpus * sizeof(cache_t));
+        return;
+    }
+#else
+    (void)p;
+    (void)n;
+#endif
+    cache_on = MM_CACHE_THREAD;
+}
+
+/*
+ * cache_size - How deep each class's stack may get, from cache_bytes.
+ *           Stacks already deeper shrink as they are popped.
+ */
+static void cache_size(void) {
+    int c;
+
+    for (c = 0; c < CACHE_SLOTS; c++)
+        cache_depth[c] = (c < SC_NSMALL) ? MAX(cache_bytes / sc_size[c], CACHE_MIN_DEPTH) : 0;
+}
+
+/*
+ * cache_class - The class of a request: the smallest that holds its block
+ */
+static inline int cache_class(size_t size) {
+    return sc_class[MAX(MINBLK, ALIGN(size + DSIZE)) >> SC_SHIFT];
+}
+
+/*
+ * cache_pop - A cached block of class c, NULL if there is none
+ */
+static inline void* cache_pop(int c) {
+    cache_t* tc;
+    void** bp;
+
+#ifdef MM_RSEQ
+    if (cache_on == MM_CACHE_CPU)
+        return rseq_pop(RSEQ(), &cpu_cache[0].head[c]);
+#endif
+    tc = (my_cache_gen == cache_gen) ? my_cache : thread_cache();
+    if (tc == NULL || (bp = tc->head[c]) == NULL)
+        return NULL;
+    tc->head[c] = bp[0];
+    return bp;
+}
+
+/*
+ * cache_push - Cache block bp on the stack of class c, 0 if it is full
+ */
+static inline int cache_push(void* bp, int c) {
+    cache_t* tc;
+    uintptr_t depth;
+
+#ifdef MM_RSEQ
+    if (cache_on == MM_CACHE_CPU)
+        return rseq_push(RSEQ(), &cpu_cache[0].head[c], bp, cache_depth[c]);
+#endif
+    tc = (my_cache_gen == cache_gen) ? my_cache : thread_cache();
+    if (tc == NULL)
+        return 0;
+    depth = (tc->head[c] == NULL) ? 1 : ((uintptr_t *)tc->head[c])[1] + 1;
+    if (depth > cache_depth[c])
+        return 0;
+    ((void **)bp)[0] = tc->head[c];
+    ((uintptr_t *)bp)[1] = depth;
+    tc->head[c] = bp;
+    return 1;
+}
+
+/*
+ * thread_cache - This thread's first cache access since mm_init: make its
+ *           cache, or empty the one it has, whose blocks mm_init dropped.
+ */
+static cache_t* thread_cache(void) {
+    if (my_cache == NULL) {
+        if ((my_cache = calloc(1, sizeof(cache_t))) == NULL)
+            return NULL;
+        pthread_once(&cache_once, cache_init);
+        pthread_setspecific(cache_key, my_cache);
+    } else
+        memset(my_cache, 0, sizeof(cache_t));
+    my_cache_gen = cache_gen;
+    return my_cache;
+}
+
+/*
+ * cache_init - Create the key whose destructor flushes a thread's cache
+ */
+static void cache_init(void) {
+    pthread_key_create(&cache_key, cache_retire);
+}
+
+/*
+ * cache_retire - Thread exit: give the blocks in its cache back to the
+ *           heap, unless mm_init has since, and free the cache.
+ */
+static void cache_retire(void* arg) {
+    cache_t* tc = arg;
+    void** bp;
+    int c;
+
+    if (my_cache_gen == cache_gen) {
+        LOCK();
+        for (c = 0; c < CACHE_SLOTS; c++)
+            while ((bp = tc->head[c]) != NULL) {
+                tc->head[c] = bp[0];
+                FREE_BLOCK(bp);
+            }
+        UNLOCK();
+    }
+    free(tc);
+    my_cache = NULL;
+}
+#endif
+
+#ifdef MM_RSEQ
+/*
+ * The rseq critical sections. Each one runs from label 1 up to label 2,
+ * ending with the one store that commits it; the descriptor at 3 tells
+ * the kernel so, and where to go on an abort (4, right behind the
+ * signature it checks), which is back to 5 to start over. The section
+ * finds this CPU's stack head at slot + (cpu << CACHE_SHIFT), slot being
+ * CPU 0's, and gives up if the CPU is out of range.
+ */
+#define RSEQ_CS \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0, 0\n\t" \
+    ".quad 1f, 2f - 1f, 4f\n\t" \
+    ".popsection\n\t" \
+    "5:\n\t" \
+    "lea 3b(%%rip), %[p]\n\t" \
+    "mov %[p], 8(%[rs])\n\t"
+#define RSEQ_ABORT \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long %c[sig]\n\t" \
+    "4:\n\t" \
+    "jmp 5b\n\t" \
+    ".popsection\n\t"
+
+typedef char cache_size_check[sizeof(cache_t) == (1 << CACHE_SHIFT) ? 1 : -1];
+
+/*
+ * rseq_pop - Pop the top block off this CPU's stack, NULL if it is empty
+ */
+static inline void* rseq_pop(struct rseq* rs, void** slot) {
+    void* bp;
+    uintptr_t p, next;
+
+    __asm__ __volatile__(
+        RSEQ_CS
+        "1:\n\t"
+        "xor %[bp], %[bp]\n\t"
+        "mov 4(%[rs]), %k[p]\n\t"         // rs->cpu_id
+        "cmp %[ncpus], %k[p]\n\t"
+        "jae 2f\n\t"
+        "shl %[shift], %[p]\n\t"
+        "add %[slot], %[p]\n\t"
+        "mov (%[p]), %[bp]\n\t"
+        "test %[bp], %[bp]\n\t"
+        "jz 2f\n\t"
+        "mov (%[bp]), %[next]\n\t"
+        "mov %[next], (%[p])\n\t"         // commit
+        "2:\n\t"
+        RSEQ_ABORT
+        : [bp] "=&r" (bp), [p] "=&r" (p), [next] "=&r" (next)
+        : [rs] "r" (rs), [slot] "rm" (slot), [ncpus] "m" (cache_ncpus),
+          [shift] "i" (CACHE_SHIFT), [sig] "i" (RSEQ_SIG)
+        : "memory", "cc");
+    return bp;
+}
+
+/*
+ * rseq_push - Push block bp on this CPU's stack unless that makes it
+ *           deeper than max. Return the new depth, 0 if not pushed.
+ */
+static inline int rseq_push(struct rseq* rs, void** slot, void* bp, uintptr_t max) {
+    uintptr_t p, top, depth;
+
+    __asm__ __volatile__(
+        RSEQ_CS
+        "1:\n\t"
+        "xor %[depth], %[depth]\n\t"
+        "mov 4(%[rs]), %k[p]\n\t"         // rs->cpu_id
+        "cmp %[ncpus], %k[p]\n\t"
+        "jae 2f\n\t"
+        "shl %[shift], %[p]\n\t"
+        "add %[slot], %[p]\n\t"
+        "mov (%[p]), %[top]\n\t"
+        "test %[top], %[top]\n\t"
+        "jz 7f\n\t"
+        "mov %c[w](%[top]), %[depth]\n\t"
+        "7:\n\t"
+        "inc %[depth]\n\t"
+        "cmp %[max], %[depth]\n\t"
+        "ja 8f\n\t"
+        "mov %[top], (%[bp])\n\t"
+        "mov %[depth], %c[w](%[bp])\n\t"
+        "mov %[bp], (%[p])\n\t"           // commit
+        "2:\n\t"
+        "jmp 9f\n\t"
+        "8:\n\t"
+        "xor %[depth], %[depth]\n\t"
+        "9:\n\t"
+        RSEQ_ABORT
+        : [p] "=&r" (p), [top] "=&r" (top), [depth] "=&r" (depth)
+        : [rs] "r" (rs), [slot] "rm" (slot), [bp] "r" (bp), [max] "rm" (max),
+          [ncpus] "m" (cache_ncpus), [shift] "i" (CACHE_SHIFT),
+          [w] "i" (sizeof(void *)), [sig] "i" (RSEQ_SIG)
+        : "memory", "cc");
+    return (int)depth;
+}
+#endif
+
+/*
+ * mm_ctl - Read and/or set the knob called name, see mm.h
+ */
+int mm_ctl(const char *name, void *oldp, const void *newp) {
+    const ctl_t* k;
+    size_t v;
+    int i;
+
+    for (i = 0; i < NCTLS && strcmp(ctls[i].name, name) != 0; i++)
+        ;
+    if (i == NCTLS)
+        return -1;
+    k = &ctls[i];
+    if ((oldp != NULL && (k->flags & CTL_WO)) || (newp != NULL && (k->flags & CTL_RO)))
+        return -1;
+    if (oldp != NULL) {
+        LOCK();
+        *(size_t *)oldp = (k->var != NULL) ? *k->var : k->get();
+        UNLOCK();
+    }
+    if (newp == NULL)
+        return 0;
+    if ((v = *(const size_t *)newp) < k->min || v > k->max)
+        return -1;
+    if (k->flags & CTL_ALIGN)
+        v = ALIGN(v);
+    if (k->set != NULL)
+        return k->set(v);
+    LOCK();
+    *k->var = v;
+    UNLOCK();
+    return 0;
+}
+
+/*
+ * mm_ctl_parse - mm_ctl from "name=value", see mm.h
+ */
+int mm_ctl_parse(const char *opt) {
+    const char* eq = strchr(opt, '=');
+    char name[32];
+    char* end;
+    unsigned long long n;
+    size_t v;
+    int i, shift = 0;
+
+    if (eq == NULL || eq - opt >= (int)sizeof(name))
+        return -1;
+    memcpy(name, opt, eq - opt);
+    name[eq - opt] = '\0';
+    eq++;
+    if (strcmp(name, "engine") == 0)
+        for (i = 0; mm_engine_name(i) != NULL; i++)
+            if (strcmp(mm_engine_name(i), eq) == 0) {
+                v = i;
+                return mm_ctl(name, NULL, &v);
+            }
+    // strtoull would take "-1" as its largest value, and wraps silently
+    if (!isdigit((unsigned char)*eq))
+        return -1;
+    errno = 0;
+    n = strtoull(eq, &end, 10);
+    if (errno == ERANGE || n > (size_t)-1)
+        return -1;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0' || n > ((size_t)-1 >> shift))
+        return -1;
+    v = (size_t)n << shift;
+    return mm_ctl(name, NULL, &v);
+}
+
+/*
+ * mm_ctl_env - Set the knobs listed in MM_OPTIONS, once
+ */
+void mm_ctl_env(void) {
+    char* buf;
+    char* opt;
+    char* save;
+    const char* env;
+
+    if (ctl_env_read)
+        return;
+    ctl_env_read = 1;
+    if ((env = getenv("MM_OPTIONS")) == NULL)
+        return;
+    // A copy from libc, whole: a cut-off last entry could still parse
+    if ((buf = strdup(env)) == NULL) {
+        fprintf(stderr, "mm: ignoring MM_OPTIONS, out of memory\n");
+        return;
+    }
+    for (opt = strtok_r(buf, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save))
+        if (mm_ctl_parse(opt) < 0)
+            fprintf(stderr, "mm: ignoring MM_OPTIONS entry %s\n", opt);
+    free(buf);
+}
+
+/*
+ * The cache knobs: the mode, for the next mm_init, and the size, which
+ * applies at once.
+ */
+static size_t cache_mode_get(void) {
+    return cache_want;
+}
+
+static int cache_mode_set(size_t v) {
+    mm_set_cache((int)v);
+    return 0;
+}
+
+static int cache_bytes_set(size_t v) {
+    LOCK();
+    cache_bytes = v;
+#ifdef MM_CACHE
+    cache_size();
+#endif
+    UNLOCK();
+    return 0;
+}
+
+#ifdef MM_THREADSAFE
+/*
+ * bg_enable - Start the background thread (on = 1) or stop it and wait
+ *           for it to finish its pass (on = 0).
+ */
+static int bg_enable(size_t on) {
+    pthread_t t;
+    int ret = 0;
+
+    pthread_mutex_lock(&bg_lock);
+    if (on && !bg_on) {
+        bg_stop = 0;
+        if (pthread_create(&bg_thread, NULL, bg_main, NULL) == 0)
+            bg_on = 1;
+        else
+            ret = -1;
+    } else if (!on && bg_on) {
+        bg_stop = 1;
+        bg_on = 0;
+        t = bg_thread;
+        pthread_cond_signal(&bg_wake);
+        pthread_mutex_unlock(&bg_lock);
+        pthread_join(t, NULL);
+        return 0;
+    }
+    pthread_mutex_unlock(&bg_lock);
+    return ret;
+}
+
+/*
+ * bg_main - The background thread: a pass every bg_interval ms until stopped
+ */
+static void* bg_main(void* arg) {
+    struct timespec ts;
+
+    pthread_mutex_lock(&bg_lock);
+    while (!bg_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += bg_interval / 1000;
+        ts.tv_nsec += (bg_interval % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&bg_wake, &bg_lock, &ts);
+        if (bg_stop)
+            break;
+        pthread_mutex_unlock(&bg_lock);
+        bg_pass(1);
+        pthread_mutex_lock(&bg_lock);
+    }
+    pthread_mutex_unlock(&bg_lock);
+    return arg;
+}
+#else
+static int bg_enable(size_t on) {
+    return on ? -1 : 0;     // no thread without the thread-safe build
+}
+#endif
+
+/*
+ * bg_run - "bg.run": one pass in the caller, less the per-CPU cache
+ *          decay, which would have to move the caller to every CPU
+ */
+static int bg_run(size_t unused) {
+    (void)unused;
+    bg_pass(0);
+    return 0;
+}
+
+/*
+ * bg_pass - One pass of the background work over every heap, and over
+ *           the per-CPU caches too if decay. The lock is dropped between
+ *           steps, so the heaps are found again by position each time;
+ *           one made or destroyed meanwhile at worst shifts the rest by one.
+ */
+static void bg_pass(int decay) {
+    mm_heap_t* h;
+    int i = 0, n, step = 0;
+
+#ifdef MM_RSEQ
+    if (decay && cache_on == MM_CACHE_CPU && bg_decay > 0)
+        cache_decay();
+#else
+    (void)decay;
+#endif
+    for (;;) {
+        LOCK();
+        for (h = &main_heap, n = i; h != NULL && n > 0; h = h->next, n--)
+            ;
+        if (h == NULL) {
+            bg_passes++;
+            UNLOCK();
+            return;
+        }
+        use_heap(h);
+        if ((step = bg_heap(step)) < 0) {
+            i++;
+            step = 0;
+        }
+        use_heap(&main_heap);
+        UNLOCK();
+    }
+}
+
+/*
+ * bg_heap - Step c of the pass over heap, with the lock held: purge up to
+ *           BG_VISIT blocks of the first non-empty list from c on, going
+ *           on where the last step stopped if that was in the same list,
+ *           or past the last list, prefault or trim above the top.
+ *           Returns the next step, -1 once the heap is done. Left alone
+ *           before the first mm_init, and if memlib's brk is not its top,
+ *           as after mem_reset_brk before mm_init.
+ */
+static int bg_heap(int c) {
+    size_t size, grown;
+    char* bp;
+    int n;
+
+    if (heap->heap_listp == NULL ||
+        (char *)mem_heap_lo() + heap->heap_bytes != (char *)mem_heap_hi() + 1)
+        return -1;
+    if (c < SC_NLISTS && bg_purge > 0) {
+        c = bitmap_next(heap->list_map, SC_NLISTS, MAX(c, list_of(MAX(bg_purge, MINBLK))));
+        if (c < SC_NLISTS) {
+            bp = (heap->bg_next != NULL && heap->bg_list == c) ? heap->bg_next : heap->freelist_head[c];
+            for (n = 0; !IS_ALLOC(HEADER(bp)) && n < BG_VISIT; bp = NEXT_PTR(bp), n++) {
+                size = GET_SIZE(HEADER(bp));
+                if (size < bg_purge || (GET(HEADER(bp)) & PURGED))
+                    continue;
+                // Keep the list links and the footer
+                bg_purged += mem_purge(bp + 2*sizeof(void *), FOOTER(bp));
+                SET_INT(HEADER(bp), PACK(size, PURGED));
+                SET_INT(FOOTER(bp), PACK(size, PURGED));
+            }
+            if (!IS_ALLOC(HEADER(bp))) {
+                heap->bg_next = bp;
+                heap->bg_list = c;
+                return c;
+            }
+            heap->bg_next = NULL;
+            return c + 1;
+        }
+    }
+    grown = (heap->heap_bytes > heap->bg_bytes) ? heap->heap_bytes - heap->bg_bytes : 0;
+    heap->bg_bytes = heap->heap_bytes;
+    if (grown > 0) {
+        heap->bg_idle = 0;
+        if (bg_ahead > 0)
+            mem_prefault(MIN(grown, bg_ahead));
+    } else if (bg_trim > 0 && heap->bg_idle < bg_trim && ++heap->bg_idle == bg_trim) {
+        // Once per idle spell: nothing above the top is committed again until it grows
+        bg_purged += mem_trim();
+    }
+    return -1;
+}
+
+#ifdef MM_RSEQ
+/*
+ * cache_decay - Free bg_decay percent of the blocks in every CPU's cache.
+ *           The thread moves to each CPU it may run on whose cache holds
+ *           anything and pops from there with the same rseq sections as
+ *           the cache's users; the depth of the top block says how many
+ *           to take. An empty cache is seen from here without moving.
+ */
+static void cache_decay(void) {
+    cpu_set_t mask, one;
+    void* got[BG_BATCH];
+    uintptr_t want, done;
+    unsigned long gen = cache_gen;
+    int cpu, c, i, n;
+
+    if (sched_getaffinity(0, sizeof(mask), &mask) != 0)
+        return;
+    for (cpu = 0; cpu < (int)cache_ncpus && cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &mask))
+            continue;
+        // A racy look, but a cache that fills meanwhile just waits a pass
+        for (c = 0; c < CACHE_SLOTS; c++)
+            if (__atomic_load_n(&cpu_cache[cpu].head[c], __ATOMIC_RELAXED) != NULL)
+                break;
+        if (c == CACHE_SLOTS)
+            continue;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) != 0)
+            continue;
+        for (c = 0; c < CACHE_SLOTS; c++) {
+            if ((got[0] = rseq_pop(RSEQ(), &cpu_cache[0].head[c])) == NULL)
+                continue;
+            want = (((uintptr_t *)got[0])[1] * bg_decay + 99) / 100;
+            for (n = 1, done = 0; ; n = 0) {
+                while (n < BG_BATCH && done + n < want &&
+                       (got[n] = rseq_pop(RSEQ(), &cpu_cache[0].head[c])) != NULL)
+                    n++;
+                LOCK();
+                if (cache_gen == gen)       // else mm_init has dropped them
+                    for (i = 0; i < n; i++)
+                        FREE_BLOCK(got[i]);
+                UNLOCK();
+                done += n;
+                if (n < BG_BATCH || done >= want)
+                    break;
+            }
+        }
+    }
+    sched_setaffinity(0, sizeof(mask), &mask);
+}
+#endif
+
+/*
+ * numa_detect - Read which CPUs each node has into cpu_node and return the
+ *           number of nodes, counting up to the highest one present.
+ */
+static int numa_detect(void) {
+    char path[128];
+    FILE* fp;
+    int node, n = 0, a, b, c;
+
+    memset(cpu_node, 0, sizeof(cpu_node));
+    for (node = 0; node < NUMA_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", node);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        n = node + 1;
+        // A list of ranges, like "0-3,8-11"
+        while (fscanf(fp, "%d", &a) == 1) {
+            b = a;
+            if ((c = getc(fp)) == '-') {
+                if (fscanf(fp, "%d", &b) != 1)
+                    break;
+                c = getc(fp);
+            }
+            for (; a <= b && a < NUMA_MAX_CPUS; a++)
+                cpu_node[a] = node;
+            if (c != ',')
+                break;
+        }
+        fclose(fp);
+    }
+    return n;
+}
+
+/*
+ * use_heap - Make h the heap the core works on, and its region the one
+ *           that mem_sbrk extends.
+ */
+static void use_heap(mm_heap_t* h) {
+    heap = h;
+    mem_region_use(h->region);
+}
+
+/*
+ * heap_of - The heap a block belongs to: the one whose region holds it,
+ *           else main_heap.
+ */
+static mm_heap_t* heap_of(void* bp) {
+    int lo = 0, hi = heap_map_len, mid;
+
+    // The last range starting at or below bp is the only one that can hold it
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((char *)bp < heap_map[mid].lo)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (lo > 0 && (char *)bp < heap_map[lo - 1].hi)
+        return heap_map[lo - 1].heap;
+    return &main_heap;
+}
+
+/*
+ * map_heap - Enter h's range in heap_map, -1 if the map can't grow
+ */
+static int map_heap(mm_heap_t* h) {
+    heap_range_t* map;
+    void* lo;
+    void* hi;
+    int i;
+
+    if (heap_map_len == heap_map_cap) {
+        if ((map = realloc(heap_map, 2 * (heap_map_cap + 8) * sizeof(heap_range_t))) == NULL)
+            return -1;
+        heap_map = map;
+        heap_map_cap = 2 * (heap_map_cap + 8);
+    }
+    mem_region_range(h->region, &lo, &hi);
+    for (i = heap_map_len; i > 0 && heap_map[i - 1].lo > (char *)lo; i--)
+        heap_map[i] = heap_map[i - 1];
+    heap_map[i].lo = lo;
+    heap_map[i].hi = hi;
+    heap_map[i].heap = h;
+    heap_map_len++;
+    return 0;
+}
+
+/*
+ * unmap_heap - Take h's range out of heap_map
+ */
+static void unmap_heap(mm_heap_t* h) {
+    int i;
+
+    for (i = 0; i < heap_map_len && heap_map[i].heap != h; i++)
+        ;
+    if (i == heap_map_len)
+        return;
+    memmove(&heap_map[i], &heap_map[i + 1], (heap_map_len - i - 1) * sizeof(heap_range_t));
+    heap_map_len--;
+}
+
+/*
+ * mm_heap_walk - Call fn for every block between the prologue and the
+ *           epilogue of each heap. The first block starts right after the
+ *           8 words that init_heap took for the prologue/epilogue.
+ */
+void mm_heap_walk(mm_walk_fn fn, void *arg) {
+    mm_block_t blk;
+    mm_heap_t* h;
+    char* bp;
+
+    LOCK();
+    blk.overhead = DSIZE;
+    FOR_EACH_HEAP(h) {
+        for (bp = (char *)h->heap_listp + 8*WSIZE; GET_SIZE(HEADER(bp)) > 0; bp = NEXT_BLK(bp)) {
+            blk.payload = bp;
+            blk.size = GET_SIZE(HEADER(bp));
+            blk.allocated = IS_ALLOC(HEADER(bp));
+            fn(&blk, arg);
+        }
+    }
+    UNLOCK();
+}
+
+/*
+ * mm_freelists - Report the length of each size class's free list, summed
+ *           over the heaps.
+ */
+int mm_freelists(size_t *lengths, int n) {
+    mm_heap_t* h;
+    size_t count;
+    void* ptr;
+    int i;
+
+    LOCK();
+    for (i = 0; i < SC_NLISTS && i < n; i++) {
+        count = 0;
+        FOR_EACH_HEAP(h)
+            for (ptr = h->freelist_head[i]; IS_ALLOC(HEADER(ptr)) == 0; ptr = NEXT_PTR(ptr))
+                count++;
+        lengths[i] = count;
+    }
+    UNLOCK();
+    return SC_NLISTS;
+}
+
+/*
+ * mm_stats - Report the byte counters, scan the free lists for the free
+ *           space and its largest block, all summed over the heaps, and
+ *           sum the per-thread op counters.
+ */
+void mm_stats(struct mm_stats *st) {
+    opcount_t* ops;
+    mm_heap_t* h;
+    void* ptr;
+    int c;
+
+    memset(st, 0, sizeof(struct mm_stats));
+    LOCK();
+    FOR_EACH_HEAP(h) {
+        st->heap += h->heap_bytes;
+        st->allocated += h->alloc_bytes;
+        st->free += h->free_bytes;
+        st->free_blocks += h->free_blocks;
+        // The largest free block is on the highest non-empty list
+        if ((c = bitmap_last(h->list_map, SC_NLISTS)) >= 0)
+            for (ptr = h->freelist_head[c]; IS_ALLOC(HEADER(ptr)) == 0; ptr = NEXT_PTR(ptr))
+                st->largest_free = MAX(st->largest_free, GET_SIZE(HEADER(ptr)));
+    }
+    UNLOCK();
+
+#ifdef MM_THREADSAFE
+    pthread_once(&ops_once, ops_init);
+    pthread_mutex_lock(&ops_lock);
+    st->mallocs = retired_ops.mallocs;
+    st->frees = retired_ops.frees;
+    st->reallocs = retired_ops.reallocs;
+    for (ops = all_ops; ops != NULL; ops = ops->next) {
+        st->mallocs += ops->mallocs;
+        st->frees += ops->frees;
+        st->reallocs += ops->reallocs;
+    }
+    pthread_mutex_unlock(&ops_lock);
+#else
+    ops = OPS();
+    st->mallocs = ops->mallocs;
+    st->frees = ops->frees;
+    st->reallocs = ops->reallocs;
+#endif
+}
+
+#ifdef MM_THREADSAFE
+/*
+ * ops_init - Create the key whose destructor retires a thread's counters
+ */
+static void ops_init(void) {
+    pthread_key_create(&ops_key, ops_retire);
+}
+
+/*
+ * thread_ops - First op on this thread: allocate its counters and link them
+ *           into all_ops. They come from libc so they never show up in our heap.
+ */
+static opcount_t* thread_ops(void) {
+    pthread_once(&ops_once, ops_init);
+    if ((my_ops = calloc(1, sizeof(opcount_t))) == NULL) {
+        my_ops = &retired_ops;    // count racily rather than not at all
+        return my_ops;
+    }
+    pthread_mutex_lock(&ops_lock);
+    my_ops->next = all_ops;
+    all_ops = my_ops;
+    pthread_mutex_unlock(&ops_lock);
+    pthread_setspecific(ops_key, my_ops);
+    return my_ops;
+}
+
+/*
+ * ops_retire - Thread exit: fold its counters into retired_ops and unlink them
+ */
+static void ops_retire(void* arg) {
+    opcount_t* ops = arg;
+    opcount_t** pp;
+
+    pthread_mutex_lock(&ops_lock);
+    retired_ops.mallocs += ops->mallocs;
+    retired_ops.frees += ops->frees;
+    retired_ops.reallocs += ops->reallocs;
+    for (pp = &all_ops; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == ops) {
+            *pp = ops->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ops_lock);
+    free(ops);
+}
+#endif
+
+
+/* 
+ * malloc_block - Adjust the size to be aligned. Then check for a fit in the free list. If one is found, split() with our adjusted size.
+ *             A MERGE_DEFER engine coalesces the whole heap and looks again before giving up.
+ *             If no fit is found, grow the heap as grow_heap() decides, then split()
+ */
+CORE void* malloc_block(size_t size, int pol) {
+    size_t adjustedSize;
+    char* ptr;
+
+    // Ignore bad requests.
+    if (size == 0)
+        return NULL;
+    if (pol & GROW_ADAPT)
+        heap->grow_clock++;
+
+    // Adjust the block size to incluse header/footer + alignment.
+    if (size <= DSIZE) {
+        adjustedSize = 2*DSIZE;
+    } else {
+        adjustedSize = DSIZE * ((size + (DSIZE) + (DSIZE - 1))/ DSIZE);
+    }
+
+    // Search the free list for a fit
+    if ((ptr = find_fit(adjustedSize, pol)) != NULL) {
+        split(ptr, adjustedSize, pol);
+        return ptr;
+    }
+    if ((pol & MERGE_DEFER) && heap->deferred_frees > 0) {
+        coalesce_all(pol);
+        if ((ptr = find_fit(adjustedSize, pol)) != NULL) {
+            split(ptr, adjustedSize, pol);
+            return ptr;
+        }
+    }
+
+    // No fit found. Get more memory and place the block.
+    if ((ptr = grow_heap(adjustedSize, pol)) == NULL)
+        return NULL;
+    split(ptr, adjustedSize, pol);
+    return ptr;
+
+}
+
+/*
+ * free_block - Set the HEADER and FOOTER tags to the size currently allocated, then coalesce(),
+ *              or under MERGE_DEFER just put the block on its list.
+ *              Returns the free block that ptr ended up in.
+ */
+CORE void* free_block(void *ptr, int pol) {
+    size_t size = GET_SIZE(HEADER(ptr));
+
+    PREFETCH(HEADER(NEXT_BLK(ptr)));        // coalesce reads it next
+    heap->alloc_bytes -= size;
+    SET_INT(HEADER(ptr), PACK(size, 0));
+    SET_INT(FOOTER(ptr), PACK(size, 0));
+    if (pol & MERGE_DEFER) {
+        heap->deferred_frees++;
+        return insert(ptr, pol);
+    }
+    return coalesce(ptr, pol);
+}
+
+/*
+ * realloc_block - Realloc will fall into these cases:
+ *					- Bad request | size is 0 so free the block
+ 					- The size requested is smaller than the current block so do no work
+ 					- The size requested is larger than the current allocated block:
+ 						- The next block could be free and have enough space to fit the 
+ 							new request when combined with the current block. Check and
+ 							combine if possible. At the end of the heap, first extend the
+ 							heap by whatever the two are short of.
+ 						- Otherwise allocate a new block and then copy the user data over,
+ 							freeing the original block.
+ */
+CORE void* realloc_block(void *ptr, size_t size, int pol) {
+    if (size <= 0) {
+        free_block(ptr, pol);
+        return ptr;
+    } else if (size + 2*DSIZE <= GET_SIZE(HEADER(ptr))) {
+        return ptr;
+    } else {
+        
+        char* next = NEXT_BLK(ptr);
+        size_t asize, have;
+
+        // At the end of the heap, grow the heap under the block rather than move it
+        if (GET_SIZE(HEADER(next)) == 0 || 
+            (!IS_ALLOC(HEADER(next)) && GET_SIZE(HEADER(NEXT_BLK(next))) == 0)) {
+            asize = DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
+            have = GET_SIZE(HEADER(ptr)) + (IS_ALLOC(HEADER(next)) ? 0 : GET_SIZE(HEADER(next)));
+            if (have < asize && extend_heap(MAX(asize - have, MINBLK)/WSIZE, pol) == NULL)
+                return NULL;
+        }
+
+        int next_block_available = IS_ALLOC(HEADER(NEXT_BLK(ptr)));
+        int current_size = GET_SIZE(HEADER(ptr));
+        int next_size = GET_SIZE(HEADER(NEXT_BLK(ptr)));
+
+        if (!next_block_available && (next_size + current_size >= size + DSIZE)) {
+            erase(NEXT_BLK(ptr));
+            SET_INT(HEADER(ptr), PACK(next_size + current_size, 1));
+            SET_INT(FOOTER(ptr), PACK(next_size + current_size, 1));
+            heap->alloc_bytes += next_size;
+            return ptr;
+        }
+        
+
+        // Copy only what the old block holds
+        void* new_ptr = malloc_block(size, pol);
+        if (new_ptr == NULL)
+            return NULL;
+        memops_copy(new_ptr, ptr, MIN((size_t)current_size - DSIZE, size));
+        free_block(ptr, pol);
+        return new_ptr;
+        
+    }
+}
+        
+    
+
+
+/* 
+ * extend_heap - Extend the heap with an even number of blocks. Set the HEADER and FOOTER pointers
+ *               to be this new size, and the NEXT_BLK to be empty. Then coalesce(), whatever
+ *               the merge policy, so the new space joins a free block at the end of the heap.
+ */
+CORE void* extend_heap(size_t words, int pol) {
+    char* bp;
+    size_t size;
+
+    // Alocate an even number of blocks to maintain double word alignment
+    size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
+    if ((long)(bp = mem_sbrk(size)) == -1)
+        return NULL;
+    heap->heap_bytes += size;
+
+    /* Initialize the free block header/footer and the epilogue block */
+    SET_INT(HEADER(bp), PACK(size, 0));             // Free block header
+    SET_INT(FOOTER(bp), PACK(size, 0));             // Free block footer
+    SET_INT(HEADER(NEXT_BLK(bp)), PACK(0, 1));      // New Epilogue Header
+
+    // Coalesce if the previous block was free
+    return coalesce(bp, pol);
+}
+
+/*
+ * grow_heap - Extend the heap so a block of aSize fits at its end. If the last
+ *             block is free, extend_heap merges the new space into it, so only
+ *             the shortfall is asked for. Otherwise the growth policy decides:
+ *             grow_chunk at least, exactly aSize under GROW_EXACT, or under
+ *             GROW_ADAPT a step that doubles while extensions come in bursts,
+ *             up to GROW_MAX and to a share of the heap so that the unused space
+ *             at the end stays bounded, and halves for each GROW_STABLE mallocs
+ *             the heap went without one.
+ */
+CORE void* grow_heap(size_t aSize, int pol) {
+    char* tail = PREV_BLK((char *)mem_heap_hi() + 1);
+    unsigned long since = heap->grow_clock - heap->grow_last;
+    size_t need;
+
+    if (pol & GROW_ADAPT) {
+        if (since < GROW_BURST)
+            heap->grow_step = MAX(MIN(2*heap->grow_step, MIN(GROW_MAX, heap->heap_bytes / GROW_SHARE)), grow_chunk);
+        else if (since >= GROW_STABLE)
+            heap->grow_step = (since / GROW_STABLE >= 8) ? grow_chunk 
+                                                         : MAX(heap->grow_step >> (since / GROW_STABLE), grow_chunk);
+        heap->grow_last = heap->grow_clock;
+    }
+
+    if (!IS_ALLOC(HEADER(tail)))
+        need = aSize - GET_SIZE(HEADER(tail));
+    else if (pol & GROW_EXACT)
+        need = aSize;
+    else if (pol & GROW_ADAPT)
+        need = MAX(aSize, heap->grow_step);
+    else
+        need = MAX(aSize, grow_chunk);
+    return extend_heap(need/WSIZE, pol);
+}
+
+/* 
+ * coalesce - Merge free blocks to prevent too small of free blocks. Erase the NEXT_BLK, PREV_BLK, both,
+ *            or neither, depending on if they're allocated. Then, merge the consecutive free blocks and insert()
+ */
+CORE void* coalesce(void* ptr, int pol) {
+    
+    size_t prev_alloc = IS_ALLOC(FOOTER(PREV_BLK(ptr))) || PREV_BLK(ptr) == ptr;
+    size_t next_alloc = IS_ALLOC(HEADER(NEXT_BLK(ptr)));
+    size_t size = GET_SIZE(HEADER(ptr));
+
+    // Both unlinks below may miss; get their loads going together
+    if (!next_alloc)
+        PREFETCH_LINKS(NEXT_BLK(ptr));
+    if (!prev_alloc)
+        PREFETCH_LINKS(PREV_BLK(ptr));
+
+    if (prev_alloc && next_alloc) {				// Souronding blocks are allocated
+    	// Do nothing
+
+    } else if (prev_alloc && !next_alloc) {		// Next block is free
+        size += GET_SIZE(HEADER(NEXT_BLK(ptr)));
+        erase(NEXT_BLK(ptr));
+        SET_INT(HEADER(ptr), PACK(size, 0));
+        SET_INT(FOOTER(ptr), PACK(size, 0));
+
+    } else if (!prev_alloc && next_alloc) {		// Previous block is free
+        size += GET_SIZE(HEADER(PREV_BLK(ptr)));
+        ptr = PREV_BLK(ptr);
+        erase(ptr);
+        SET_INT(HEADER(ptr), PACK(size, 0));
+        SET_INT(FOOTER(ptr), PACK(size, 0));
+
+    } else {									// Both next & prev block are free
+        size += GET_SIZE(HEADER(PREV_BLK(ptr))) + GET_SIZE(HEADER(NEXT_BLK(ptr)));
+        erase(NEXT_BLK(ptr));
+        erase(PREV_BLK(ptr));
+        ptr = PREV_BLK(ptr);
+
+        SET_INT(HEADER(ptr), PACK(size, 0));
+        SET_INT(FOOTER(ptr), PACK(size, 0));
+        
+    }
+
+    return insert(ptr, pol);
+}
+
+/*
+ * coalesce_all - The MERGE_DEFER engines' catch-up: walk the heap and merge
+ *                every run of adjacent free blocks into one.
+ */
+CORE void coalesce_all(int pol) {
+    char* bp;
+    char* next;
+    size_t size;
+
+    for (bp = (char *)heap->heap_listp + 8*WSIZE; GET_SIZE(HEADER(bp)) > 0; bp = NEXT_BLK(bp)) {
+        if (IS_ALLOC(HEADER(bp)) || IS_ALLOC(HEADER(NEXT_BLK(bp))))
+            continue;
+        erase(bp);
+        size = GET_SIZE(HEADER(bp));
+        while (!IS_ALLOC(HEADER(next = NEXT_BLK(bp)))) {
+            erase(next);
+            size += GET_SIZE(HEADER(next));
+            SET_INT(HEADER(bp), PACK(size, 0));
+            SET_INT(FOOTER(bp), PACK(size, 0));
+        }
+        insert(bp, pol);
+    }
+    heap->deferred_frees = 0;
+}
+
+/* 
+ * find_fit - Find a fit for a chunk of aSize. First fit in aSize's own size
+ *            class, whose blocks may be smaller than aSize; any block in a
+ *            bigger class fits, so from there on the first one found is taken.
+ *            Best fit takes the smallest fitting block of the first class
+ *            that has one, stopping early on an exact fit. The bitmap of
+ *            non-empty lists gives the next class to look at.
+ */
+CORE void* find_fit(size_t aSize, int pol) {
+    void* ptr = NULL;
+    void* best = NULL;
+    int c = list_of(aSize);
+
+    if (pol & FIT_BEST) {
+        for (; (c = bitmap_next(heap->list_map, SC_NLISTS, c)) < SC_NLISTS; c++) {
+            for (ptr = heap->freelist_head[c]; IS_ALLOC(HEADER(ptr)) == 0; ptr = NEXT_PTR(ptr)) {
+                PREFETCH(HEADER(NEXT_PTR(ptr)));
+                if (GET_SIZE(HEADER(ptr)) == aSize)
+                    return ptr;
+                if (GET_SIZE(HEADER(ptr)) > aSize && 
+                    (best == NULL || GET_SIZE(HEADER(ptr)) < GET_SIZE(HEADER(best))))
+                    best = ptr;
+            }
+            if (best != NULL)
+                return best;
+        }
+        return NULL;
+    }
+
+    for (ptr = heap->freelist_head[c]; IS_ALLOC(HEADER(ptr)) == 0; ptr = NEXT_PTR(ptr)) {
+        PREFETCH(HEADER(NEXT_PTR(ptr)));
+        if (GET_SIZE(HEADER(ptr)) >= aSize) {
+            return ptr;
+        }
+    }
+    if ((c = bitmap_next(heap->list_map, SC_NLISTS, c + 1)) < SC_NLISTS)
+        return heap->freelist_head[c];
+    return NULL;
+}
+
+/*
+ * list_of - The free list for a block of this size: the largest class not
+ *           bigger than it, so every block on list c is at least sc_size[c].
+ *           A table lookup for small sizes, the top bit for large ones.
+ */
+static inline int list_of(size_t size) {
+    int c;
+
+    if (size > SC_MAX_SMALL) {
+        c = SC_NSMALL + (31 - __builtin_clz((unsigned int)size)) - SC_MAX_SMALL_LOG2;
+        return c < SC_NLISTS ? c : SC_NLISTS - 1;
+    }
+    c = sc_class[size >> SC_SHIFT];
+    return c - (sc_size[c] > size);
+}
+
+/* 
+ *split - Places the new segment into the free block. Will slice
+ *        if there is split_min or more extra space at the end by setting the tags
+ *        and calling coalesce() (insert() when merging is deferred).
+ */
+CORE void split(void* ptr, size_t neededSize, int pol) {
+    
+    size_t blockSize = GET_SIZE(HEADER(ptr));   
+
+    erase(ptr);     // while the tags still say which list it is on
+    if ((blockSize - neededSize) >= split_min) { 
+        SET_INT(HEADER(ptr), PACK(neededSize, 1));
+        SET_INT(FOOTER(ptr), PACK(neededSize, 1));
+        heap->alloc_bytes += neededSize;
+        ptr = NEXT_BLK(ptr);
+        SET_INT(HEADER(ptr), PACK(blockSize-neededSize, 0));
+        SET_INT(FOOTER(ptr), PACK(blockSize-neededSize, 0));
+        if (pol & MERGE_DEFER)
+            insert(ptr, pol);
+        else
+            coalesce(ptr, pol);
+    } else {
+        SET_INT(HEADER(ptr), PACK(blockSize, 1));
+        SET_INT(FOOTER(ptr), PACK(blockSize, 1));
+        heap->alloc_bytes += blockSize;
+    }
+}
+
+/* 
+ * insert - Places the new segment into the freelist of its size class: at
+ *          the front, or under ORDER_ADDR in front of the first block above it.
+ */
+CORE void* insert(void* new_ptr, int pol) {
+	int c = list_of(GET_SIZE(HEADER(new_ptr)));
+	char* prev = NULL;
+	char* next = heap->freelist_head[c];
+
+	if (pol & ORDER_ADDR) {
+		while (IS_ALLOC(HEADER(next)) == 0 && next < (char *)new_ptr) {
+			PREFETCH(HEADER(NEXT_PTR(next)));
+			prev = next;
+			next = NEXT_PTR(next);
+		}
+	}
+
+	SET_PTR(NEXT_PTR(new_ptr), next);
+        SET_PTR(PREV_PTR(new_ptr), prev);
+        SET_PTR(PREV_PTR(next), new_ptr);
+
+	if (prev)
+		SET_PTR(NEXT_PTR(prev), new_ptr);
+	else
+		heap->freelist_head[c] = new_ptr;
+	bitmap_set(heap->list_map, c);
+	heap->free_bytes += GET_SIZE(HEADER(new_ptr));
+	heap->free_blocks++;
+
+	return new_ptr;
+}
+
+/*
+ * The engines: the core instantiated for every combination of policies.
+ * engines[0] is the allocator's long-standing behaviour and the default.
+ */
+#define ENGINES(X) \
+    X(first_lifo_now_chunk,   0) \
+    X(first_lifo_now_exact,   GROW_EXACT) \
+    X(first_lifo_defer_chunk, MERGE_DEFER) \
+    X(first_lifo_defer_exact, MERGE_DEFER | GROW_EXACT) \
+    X(first_addr_now_chunk,   ORDER_ADDR) \
+    X(first_addr_now_exact,   ORDER_ADDR | GROW_EXACT) \
+    X(first_addr_defer_chunk, ORDER_ADDR | MERGE_DEFER) \
+    X(first_addr_defer_exact, ORDER_ADDR | MERGE_DEFER | GROW_EXACT) \
+    X(best_lifo_now_chunk,    FIT_BEST) \
+    X(best_lifo_now_exact,    FIT_BEST | GROW_EXACT) \
+    X(best_lifo_defer_chunk,  FIT_BEST | MERGE_DEFER) \
+    X(best_lifo_defer_exact,  FIT_BEST | MERGE_DEFER | GROW_EXACT) \
+    X(best_addr_now_chunk,    FIT_BEST | ORDER_ADDR) \
+    X(best_addr_now_exact,    FIT_BEST | ORDER_ADDR | GROW_EXACT) \
+    X(best_addr_defer_chunk,  FIT_BEST | ORDER_ADDR | MERGE_DEFER) \
+    X(best_addr_defer_exact,  FIT_BEST | ORDER_ADDR | MERGE_DEFER | GROW_EXACT) \
+    X(first_lifo_now_adapt,   GROW_ADAPT) \
+    X(first_lifo_defer_adapt, MERGE_DEFER | GROW_ADAPT) \
+    X(first_addr_now_adapt,   ORDER_ADDR | GROW_ADAPT) \
+    X(first_addr_defer_adapt, ORDER_ADDR | MERGE_DEFER | GROW_ADAPT) \
+    X(best_lifo_now_adapt,    FIT_BEST | GROW_ADAPT) \
+    X(best_lifo_defer_adapt,  FIT_BEST | MERGE_DEFER | GROW_ADAPT) \
+    X(best_addr_now_adapt,    FIT_BEST | ORDER_ADDR | GROW_ADAPT) \
+    X(best_addr_defer_adapt,  FIT_BEST | ORDER_ADDR | MERGE_DEFER | GROW_ADAPT)
+
+#define ENGINE_FUNCS(name, pol) \
+    static void* name##_malloc(size_t size) { return malloc_block(size, pol); } \
+    static void* name##_free(void* ptr) { return free_block(ptr, pol); } \
+    static void* name##_realloc(void* ptr, size_t size) { return realloc_block(ptr, size, pol); }
+#define ENGINE_ENTRY(name, pol) \
+    { #name, pol, name##_malloc, name##_free, name##_realloc },
+
+ENGINES(ENGINE_FUNCS)
+
+static const engine_t engines[] = {
+    ENGINES(ENGINE_ENTRY)
+};
+
+#define NENGINES			((int)(sizeof(engines) / sizeof(engines[0])))
+
+/*
+ * mm_engine_name - Name of engine i, or NULL past the last one
+ */
+const char* mm_engine_name(int i) {
+    return (i >= 0 && i < NENGINES) ? engines[i].name : NULL;
+}
+
+/*
+ * mm_set_engine - Switch engines. The free lists are laid out by the
+ *                 engine's policy, so this takes effect at the next mm_init
+ *                 and for heaps created from then on.
+ */
+int mm_set_engine(const char* name) {
+    int i;
+
+    for (i = 0; i < NENGINES; i++) {
+        if (strcmp(engines[i].name, name) == 0) {
+            LOCK();
+            engine_index = i;
+            UNLOCK();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * engine_get, engine_set - mm_ctl's "engine": mm_set_engine by index
+ */
+static size_t engine_get(void) {
+    return engine_index;
+}
+
+static int engine_set(size_t v) {
+    return (v < NENGINES) ? mm_set_engine(engines[v].name) : -1;
+}
+
+/*
+ * select_engine - init_heap's half of mm_set_engine
+ */
+static void select_engine(void) {
+    heap->engine = &engines[engine_index];
+}
+
+/*
+ * mm_set_check - Turn self-checking after every op on or off
+ */
+void mm_set_check(int level) {
+    LOCK();
+    check_level = level;
+    UNLOCK();
+}
+
+/*
+ * mm_check - Check every heap with the lock held
+ */
+int mm_check(int verbose) {
+    mm_heap_t* h;
+    int errors = 0;
+
+    LOCK();
+    FOR_EACH_HEAP(h) {
+        use_heap(h);
+        errors += check_heap(verbose);
+    }
+    use_heap(&main_heap);
+    UNLOCK();
+    return errors;
+}
+
+/*
+ * check_heap - Check the whole heap:
+ *              - the prologue header and the epilogue are intact
+ *              - every block has matching, aligned, in-bounds boundary tags
+ *              - no two free blocks are adjacent (they should have been coalesced)
+ *              - the free list holds exactly the free blocks, with consistent links
+ *            Returns the number of problems found.
+ */
+static int check_heap(int verbose) {
+    char* lo = mem_heap_lo();
+    char* hi = mem_heap_hi();
+    char* bp;
+    char* prev = NULL;
+    void* ptr;
+    size_t nfree = 0, nlisted = 0, listed_bytes = 0;
+    int errors = 0, c;
+
+    if (heap->heap_listp == NULL)
+        return 0;
+
+    if (GET((char *)heap->heap_listp + WSIZE) != PACK(DSIZE, 1)) {
+        if (verbose)
+            fprintf(stderr, "mm_check: prologue header corrupted (%#x)\n", GET((char *)heap->heap_listp + WSIZE));
+        errors++;
+    }
+
+    // Walk every block in address order
+    for (bp = (char *)heap->heap_listp + 8*WSIZE; GET_SIZE(HEADER(bp)) > 0; bp = NEXT_BLK(bp)) {
+        if (check_block(bp, verbose)) {
+            errors++;
+            return errors;      // sizes can't be trusted, so we can't walk any further
+        }
+        if (!IS_ALLOC(HEADER(bp))) {
+            nfree++;
+            if (prev != NULL && !IS_ALLOC(HEADER(prev)) && !(heap->engine->policy & MERGE_DEFER)) {
+                if (verbose)
+                    fprintf(stderr, "mm_check: adjacent free blocks %p and %p were not coalesced\n", prev, bp);
+                errors++;
+            }
+        }
+        prev = bp;
+    }
+
+    // bp is now just past the last block, so its header should be the epilogue
+    if (HEADER(bp) != hi - WSIZE + 1 || GET(HEADER(bp)) != PACK(0, 1)) {
+        if (verbose)
+            fprintf(stderr, "mm_check: epilogue at %p is not the last word of the heap (%p) or is corrupted (%#x)\n",
+                    HEADER(bp), hi - WSIZE + 1, GET(HEADER(bp)));
+        errors++;
+    }
+
+    // Walk the free lists, bounded by the number of free blocks in case one has a cycle
+    for (c = 0; c < SC_NLISTS; c++) {
+        if (bitmap_test(heap->list_map, c) != !IS_ALLOC(HEADER(heap->freelist_head[c]))) {
+            if (verbose)
+                fprintf(stderr, "mm_check: list %d is %sempty but its bit says otherwise\n",
+                        c, IS_ALLOC(HEADER(heap->freelist_head[c])) ? "" : "not ");
+            errors++;
+        }
+        for (ptr = heap->freelist_head[c]; IS_ALLOC(HEADER(ptr)) == 0; ptr = NEXT_PTR(ptr)) {
+            if ((char *)ptr < lo || (char *)ptr > hi) {
+                if (verbose)
+                    fprintf(stderr, "mm_check: free list entry %p lies outside the heap\n", ptr);
+                return errors + 1;
+            }
+            listed_bytes += GET_SIZE(HEADER(ptr));
+            if (++nlisted > nfree) {
+                if (verbose)
+                    fprintf(stderr, "mm_check: free lists are longer than the %lu free blocks (cycle?)\n",
+                            (unsigned long)nfree);
+                return errors + 1;
+            }
+            if (PREV_PTR(ptr) == NULL ? ptr != heap->freelist_head[c] : NEXT_PTR(PREV_PTR(ptr)) != ptr) {
+                if (verbose)
+                    fprintf(stderr, "mm_check: free list links around %p are inconsistent\n", ptr);
+                errors++;
+            }
+            if (list_of(GET_SIZE(HEADER(ptr))) != c) {
+                if (verbose)
+                    fprintf(stderr, "mm_check: free block %p of size %u is on list %d, not %d\n",
+                            ptr, GET_SIZE(HEADER(ptr)), c, list_of(GET_SIZE(HEADER(ptr))));
+                errors++;
+            }
+        }
+    }
+    if (nlisted != nfree) {
+        if (verbose)
+            fprintf(stderr, "mm_check: %lu free blocks but %lu on the free lists\n",
+                    (unsigned long)nfree, (unsigned long)nlisted);
+        errors++;
+    }
+    if (heap->free_blocks != nlisted || heap->free_bytes != listed_bytes) {
+        if (verbose)
+            fprintf(stderr, "mm_check: mm_stats counts %lu free blocks of %lu bytes, the lists hold %lu of %lu\n",
+                    (unsigned long)heap->free_blocks, (unsigned long)heap->free_bytes,
+                    (unsigned long)nlisted, (unsigned long)listed_bytes);
+        errors++;
+    }
+
+    return errors;
+}
+
+/*
+ * check_block - Check one block's boundary tags: header matches footer, the
+ *               size is aligned and at least MINBLK, and the block is in the heap.
+ */
+static int check_block(void* bp, int verbose) {
+    char* lo = mem_heap_lo();
+    char* hi = mem_heap_hi();
+    size_t size = GET_SIZE(HEADER(bp));
+
+    if ((char *)bp < lo || (char *)bp > hi || ((size_t)bp % ALIGNMENT) != 0) {
+        if (verbose)
+            fprintf(stderr, "mm_check: block %p is misaligned or outside the heap\n", bp);
+        return 1;
+    }
+    if ((size % ALIGNMENT) != 0 || size < MINBLK || (char *)bp + size - WSIZE > hi) {
+        if (verbose)
+            fprintf(stderr, "mm_check: block %p has a bad size (%lu)\n", bp, (unsigned long)size);
+        return 1;
+    }
+    if (GET(HEADER(bp)) != GET(FOOTER(bp))) {
+        if (verbose)
+            fprintf(stderr, "mm_check: block %p header (%#x) does not match footer (%#x)\n",
+                    bp, GET(HEADER(bp)), GET(FOOTER(bp)));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * check_neighbours - The incremental check: bp and the blocks on either side
+ *                    have sound tags, and if bp is free, neither neighbour is
+ *                    free and bp is linked into the free list.
+ */
+static int check_neighbours(void* bp, int verbose) {
+    char* first = (char *)heap->heap_listp + 8*WSIZE;
+    char* next;
+    char* prev;
+
+    if (check_block(bp, verbose))
+        return 1;
+
+    next = NEXT_BLK(bp);
+    if (GET_SIZE(HEADER(next)) > 0 && check_block(next, verbose))
+        return 1;
+    prev = ((char *)bp == first) ? NULL : PREV_BLK(bp);
+    if (prev != NULL && check_block(prev, verbose))
+        return 1;
+
+    if (!IS_ALLOC(HEADER(bp))) {
+        if (!(heap->engine->policy & MERGE_DEFER) &&
+            (!IS_ALLOC(HEADER(next)) || (prev != NULL && !IS_ALLOC(HEADER(prev))))) {
+            if (verbose)
+                fprintf(stderr, "mm_check: free block %p has a free neighbour\n", bp);
+            return 1;
+        }
+        if (PREV_PTR(bp) == NULL ? bp != heap->freelist_head[list_of(GET_SIZE(HEADER(bp)))]
+                                 : NEXT_PTR(PREV_PTR(bp)) != bp) {
+            if (verbose)
+                fprintf(stderr, "mm_check: free block %p is not linked into the free list\n", bp);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * check_op - Run the configured check on the block an op returned or
+ *            freed into, and abort at the first problem.
+ */
+static void check_op(void* bp) {
+    int bad;
+
+    if (check_level == MM_CHECK_FULL)
+        bad = check_heap(1);
+    else
+        bad = (bp != NULL) && check_neighbours(bp, 1);
+
+    if (bad) {
+        fprintf(stderr, "mm: heap corruption detected, aborting\n");
+        abort();
+    }
+}
+
+#ifdef MM_DEBUG
+/*
+ * Debug allocator (make DEBUG=1). Every payload is followed by canary
+ * bytes that fill the slack up to a word holding the requested size,
+ * which sits just before the footer:
+ *
+ *     | hdr | payload ... | canary (>= 8 bytes) | reqsize | ftr |
+ *
+ * mm_free checks the canary, poisons the payload and puts the block in a
+ * bounded FIFO quarantine, still marked allocated. When a block leaves
+ * the quarantine its poison is checked for writes after free. Blocks of
+ * at least guard_min bytes (see mm_set_guard) are placed at the top of
+ * the heap so they end right below a PROT_NONE page, and an overrun of
+ * more than the slack faults on the spot.
+ */
+#define CANARY_MIN			8
+#define DEBUG_EXTRA			(CANARY_MIN + WSIZE)
+#define CANARY_BYTE			0xfd
+#define POISON_BYTE			0xdb
+#define QUARANTINE_MAX		256
+#define QUARANTINE_BYTES	(1<<20)
+
+/* Flags kept in the top bits of the reqsize word */
+#define REQ_GUARDED			0x80000000u
+#define REQ_QUARANTINED		0x40000000u
+#define REQ_SIZE(w)			((w) & ~(REQ_GUARDED | REQ_QUARANTINED))
+
+/* Given an allocated block ptr bp, compute the address of its reqsize word */
+#define REQ_WORD(bp)		((char *)(bp) + GET_SIZE(HEADER(bp)) - DSIZE - WSIZE)
+
+static void*  quarantine[QUARANTINE_MAX];  // FIFO ring of freed blocks
+static int    q_head = 0;                  // oldest entry
+static int    q_count = 0;
+static size_t q_bytes = 0;                 // total block bytes in quarantine
+static size_t guard_min = 0;               // 0 = no guard pages
+static char** guards = NULL;               // pages currently PROT_NONE
+static int    nguards = 0;
+static int    maxguards = 0;
+
+static void* guarded_block(size_t);
+static void  debug_arm(char*, size_t, unsigned int);
+static void  debug_validate(void*);
+static void  quarantine_evict(void);
+static void  unguard(char*);
+static void  debug_fail(const char*, void*);
+
+/*
+ * debug_malloc - Allocate room for the canary and the reqsize word too,
+ *                from a guarded block at the top of the heap if it's large.
+ */
+static void* debug_malloc(size_t size) {
+    char* bp;
+
+    if (size == 0)
+        return NULL;
+
+    if (guard_min && size >= guard_min) {
+        if ((bp = guarded_block(size + DEBUG_EXTRA)) == NULL)
+            return NULL;
+        debug_arm(bp, size, REQ_GUARDED);
+    } else {
+        if ((bp = heap->engine->malloc_block(size + DEBUG_EXTRA)) == NULL)
+            return NULL;
+        debug_arm(bp, size, 0);
+    }
+    return bp;
+}
+
+/*
+ * debug_free - Check the pointer and its canary, poison the payload and
+ *              quarantine the block. Returns the (still allocated) block.
+ */
+static void* debug_free(void* bp) {
+    char* req;
+    size_t size;
+
+    debug_validate(bp);
+    req = REQ_WORD(bp);
+    size = REQ_SIZE(GET(req));
+    memset(bp, POISON_BYTE, size);
+    SET_INT(req, GET(req) | REQ_QUARANTINED);
+
+    while (q_count == QUARANTINE_MAX || 
+           (q_count > 0 && q_bytes + GET_SIZE(HEADER(bp)) > QUARANTINE_BYTES))
+        quarantine_evict();
+    quarantine[(q_head + q_count) % QUARANTINE_MAX] = bp;
+    q_count++;
+    q_bytes += GET_SIZE(HEADER(bp));
+    return bp;
+}
+
+/*
+ * debug_realloc - Always move the block, so stale pointers to the old one
+ *                 land in quarantined, poisoned memory.
+ */
+static void* debug_realloc(void* ptr, size_t size) {
+    void* new_ptr;
+    size_t old_size;
+
+    if (size <= 0) {
+        debug_free(ptr);
+        return ptr;
+    }
+    debug_validate(ptr);
+    old_size = REQ_SIZE(GET(REQ_WORD(ptr)));
+    if ((new_ptr = debug_malloc(size)) == NULL)
+        return NULL;
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    debug_free(ptr);
+    return new_ptr;
+}
+
+/*
+ * debug_reset - Heap h is about to be reused or unmapped: make its guard
+ *               pages writable again and forget its quarantined blocks.
+ */
+static void debug_reset(mm_heap_t* h) {
+    char* bp;
+    int i, n = 0;
+
+    for (i = nguards - 1; i >= 0; i--)      // unguard moves the last entry to i
+        if (heap_of(guards[i]) == h)
+            unguard(guards[i]);
+    q_bytes = 0;
+    for (i = 0; i < q_count; i++) {
+        bp = quarantine[(q_head + i) % QUARANTINE_MAX];
+        if (heap_of(bp) != h) {
+            quarantine[(q_head + n++) % QUARANTINE_MAX] = bp;
+            q_bytes += GET_SIZE(HEADER(bp));
+        }
+    }
+    q_count = n;
+}
+
+/*
+ * guarded_block - Extend the heap so that a block of n payload bytes ends
+ *                 just below a page-aligned guard block, and protect the
+ *                 guard block's payload page:
+ *
+ *     | free gap | hdr  A ... ftr | hdr | PROT_NONE page | ftr | epilogue |
+ *                                       ^ page aligned
+ *
+ *                 The gap in front is either empty or big enough to be a
+ *                 free block of its own.
+ */
+static void* guarded_block(size_t n) {
+    size_t page = mem_pagesize();
+    size_t asize = DSIZE * ((n + (DSIZE) + (DSIZE - 1)) / DSIZE);
+    char* brk = (char *)mem_heap_hi() + 1;
+    char* guard = (char *)(((uintptr_t)brk + asize + page - 1) & ~(uintptr_t)(page - 1));
+    char* bp;
+    size_t gap, incr;
+
+    while ((gap = guard - asize - brk) != 0 && gap < MINBLK)
+        guard += page;
+    incr = guard + page + DSIZE - brk;
+    if (mem_sbrk(incr) == (void *)-1)
+        return NULL;
+    heap->heap_bytes += incr;
+
+    // The old epilogue header becomes the header of the gap or of the block
+    bp = guard - asize;
+    SET_INT(HEADER(bp), PACK(asize, 1));
+    SET_INT(FOOTER(bp), PACK(asize, 1));
+    SET_INT(HEADER(guard), PACK(page + DSIZE, 1));
+    SET_INT(FOOTER(guard), PACK(page + DSIZE, 1));
+    SET_INT(HEADER(NEXT_BLK(guard)), PACK(0, 1));     // New Epilogue Header
+    heap->alloc_bytes += asize + page + DSIZE;
+    if (gap) {
+        // Hand the gap to the engine as if it had just been freed
+        SET_INT(HEADER(brk), PACK(gap, 1));
+        SET_INT(FOOTER(brk), PACK(gap, 1));
+        heap->alloc_bytes += gap;
+        heap->engine->free_block(brk);
+    }
+
+    if (nguards == maxguards) {
+        maxguards = maxguards ? 2*maxguards : 64;
+        if ((guards = realloc(guards, maxguards * sizeof(char *))) == NULL)
+            debug_fail("out of memory for the guard page table", bp);
+    }
+    if (mprotect(guard, page, PROT_NONE) == 0)
+        guards[nguards++] = guard;
+    return bp;
+}
+
+/*
+ * debug_arm - Record the requested size and fill the slack with canary bytes
+ */
+static void debug_arm(char* bp, size_t size, unsigned int flags) {
+    char* req = REQ_WORD(bp);
+
+    memset(bp + size, CANARY_BYTE, req - (bp + size));
+    SET_INT(req, size | flags);
+}
+
+/*
+ * debug_validate - bp must be a live block that mm_malloc returned, and its
+ *                  canary must be intact.
+ */
+static void debug_validate(void* bp) {
+    unsigned char* p;
+    char* req;
+    size_t size;
+
+    if ((char *)bp < (char *)mem_heap_lo() || (char *)bp > (char *)mem_heap_hi() ||
+        ((size_t)bp % ALIGNMENT) != 0)
+        debug_fail("free of a pointer mm_malloc never returned", bp);
+    if (!IS_ALLOC(HEADER(bp)) || GET(HEADER(bp)) != GET(FOOTER(bp)))
+        debug_fail("free of a free block or of a block with damaged tags", bp);
+    req = REQ_WORD(bp);
+    if (GET(req) & REQ_QUARANTINED)
+        debug_fail("double free", bp);
+    size = REQ_SIZE(GET(req));
+    if ((char *)bp + size + CANARY_MIN > req)
+        debug_fail("reqsize word damaged (overrun past the canary?)", bp);
+    for (p = (unsigned char *)bp + size; p < (unsigned char *)req; p++)
+        if (*p != CANARY_BYTE)
+            debug_fail("buffer overrun: canary after the payload damaged", bp);
+}
+
+/*
+ * quarantine_evict - Release the oldest quarantined block for real, after
+ *                    checking nobody wrote to it since it was freed.
+ */
+static void quarantine_evict(void) {
+    char* bp = quarantine[q_head];
+    unsigned char* p;
+    unsigned int w = GET(REQ_WORD(bp));
+    char* guard = NEXT_BLK(bp);
+    mm_heap_t* old = heap;
+
+    q_head = (q_head + 1) % QUARANTINE_MAX;
+    q_count--;
+    q_bytes -= GET_SIZE(HEADER(bp));
+
+    for (p = (unsigned char *)bp; p < (unsigned char *)bp + REQ_SIZE(w); p++)
+        if (*p != POISON_BYTE)
+            debug_fail("write to freed memory", bp);
+
+    // The block may be from another heap than the free that evicts it
+    use_heap(heap_of(bp));
+    heap->engine->free_block(bp);
+    if (w & REQ_GUARDED) {
+        unguard(guard);
+        heap->engine->free_block(guard);
+    }
+    use_heap(old);
+}
+
+/*
+ * unguard - Make a guard page writable again and drop it from the table
+ */
+static void unguard(char* guard) {
+    int i;
+
+    mprotect(guard, mem_pagesize(), PROT_READ | PROT_WRITE);
+    for (i = 0; i < nguards; i++) {
+        if (guards[i] == guard) {
+            guards[i] = guards[--nguards];
+            break;
+        }
+    }
+}
+
+/*
+ * debug_fail - Report a memory bug and abort
+ */
+static void debug_fail(const char* what, void* bp) {
+    fprintf(stderr, "mm: %s (block %p)\n", what, bp);
+    abort();
+}
+#endif
+
+/*
+ * mm_set_guard - Guard blocks of at least min_size bytes with a PROT_NONE
+ *                page (0 turns it off). Only the debug build has guard pages,
+ *                so elsewhere anything but 0 fails.
+ */
+int mm_set_guard(size_t min_size) {
+#ifdef MM_DEBUG
+    LOCK();
+    guard_min = min_size;
+    UNLOCK();
+    return 0;
+#else
+    return min_size ? -1 : 0;
+#endif
+}
+
+/*
+ * Sampling heap profiler. Like tcmalloc's, it samples an allocation each
+ * time the bytes allocated since the last sample pass a threshold drawn
+ * from an exponential distribution with mean prof_rate, so a block of
+ * size s is picked with probability 1 - exp(-s/prof_rate) however the
+ * program interleaves its requests. A sampled block gets the SAMPLED tag
+ * bit and an entry in a hash table keyed by its address, pointing at the
+ * bucket for its call stack; mm_free drops the entry. All of it is done
+ * under the allocator lock.
+ */
+#define PROF_DEPTH			32		// frames kept per stack
+#define PROF_SKIP			2		// prof_sample and mm_malloc/mm_realloc
+#define PROF_BUCKETS		1024	// hash chains for stacks
+#define PROF_SLOTS			4096	// hash chains for sampled blocks
+
+typedef struct prof_stack {
+    uintptr_t hash;
+    int depth;
+    void* pc[PROF_DEPTH];
+    unsigned long inuse_objs, alloc_objs;
+    unsigned long long inuse_bytes, alloc_bytes;
+    struct prof_stack* next;
+} prof_stack_t;
+
+typedef struct prof_block {
+    void* bp;
+    size_t size;
+    prof_stack_t* stack;
+    struct prof_block* next;
+} prof_block_t;
+
+static size_t prof_rate = 0;                    // mean bytes between samples, 0 = off
+static uint64_t prof_seed = 88172645463325252ULL;
+static prof_stack_t* prof_stacks[PROF_BUCKETS];
+static prof_block_t* prof_blocks[PROF_SLOTS];
+static prof_block_t* prof_spare = NULL;         // recycled table entries
+
+#define PROF_SLOT(bp)		((((uintptr_t)(bp)) >> 3) % PROF_SLOTS)
+
+/*
+ * prof_next - Draw the distance to the next sample, exponential with mean
+ *             prof_rate (xorshift64 for the uniform variate).
+ */
+static int64_t prof_next(void) {
+    double u;
+
+    if (prof_rate == 0)
+        return INT64_MAX;
+    prof_seed ^= prof_seed << 13;
+    prof_seed ^= prof_seed >> 7;
+    prof_seed ^= prof_seed << 17;
+    u = ((prof_seed >> 11) + 1) * (1.0 / 9007199254740993.0);    // (0, 1]
+    return (int64_t)(-log(u) * prof_rate) + 1;
+}
+
+/*
+ * prof_sample - Record bp's call stack, tag the block and draw the next
+ *               countdown. Kept out of line so the fast path stays small.
+ */
+static void __attribute__((noinline)) prof_sample(void* bp, size_t size) {
+    void* pc[PROF_DEPTH + PROF_SKIP];
+    prof_stack_t* st;
+    prof_block_t* b;
+    uintptr_t hash = 0;
+    int i, n;
+
+    prof_left = prof_next();
+
+    n = backtrace(pc, PROF_DEPTH + PROF_SKIP) - PROF_SKIP;
+    if (n < 0)
+        n = 0;
+    for (i = 0; i < n; i++)
+        hash = hash * 31 + (uintptr_t)pc[PROF_SKIP + i];
+
+    for (st = prof_stacks[hash % PROF_BUCKETS]; st != NULL; st = st->next)
+        if (st->hash == hash && st->depth == n && 
+            memcmp(st->pc, pc + PROF_SKIP, n * sizeof(void *)) == 0)
+            break;
+    if (st == NULL) {
+        if ((st = calloc(1, sizeof(prof_stack_t))) == NULL)
+            return;
+        st->hash = hash;
+        st->depth = n;
+        memcpy(st->pc, pc + PROF_SKIP, n * sizeof(void *));
+        st->next = prof_stacks[hash % PROF_BUCKETS];
+        prof_stacks[hash % PROF_BUCKETS] = st;
+    }
+
+    if ((b = prof_spare) != NULL)
+        prof_spare = b->next;
+    else if ((b = malloc(sizeof(prof_block_t))) == NULL)
+        return;
+    b->bp = bp;
+    b->size = size;
+    b->stack = st;
+    b->next = prof_blocks[PROF_SLOT(bp)];
+    prof_blocks[PROF_SLOT(bp)] = b;
+
+    st->inuse_objs++;
+    st->inuse_bytes += size;
+    st->alloc_objs++;
+    st->alloc_bytes += size;
+    SET_INT(HEADER(bp), GET(HEADER(bp)) | SAMPLED);
+    SET_INT(FOOTER(bp), GET(FOOTER(bp)) | SAMPLED);
+}
+
+/*
+ * prof_forget - bp is being freed (or moved by realloc): untag it and take
+ *               it off its stack's live counts. Returns the stack, and the
+ *               size sampled in *size unless size is NULL, for prof_relink;
+ *               NULL if bp wasn't sampled.
+ */
+static prof_stack_t* prof_forget(void* bp, size_t* size) {
+    prof_block_t** link;
+    prof_block_t* b;
+
+    // Only touch the tags of blocks we know, bp may be a bad pointer
+    for (link = &prof_blocks[PROF_SLOT(bp)]; (b = *link) != NULL; link = &b->next) {
+        if (b->bp == bp) {
+            SET_INT(HEADER(bp), GET(HEADER(bp)) & ~SAMPLED);
+            SET_INT(FOOTER(bp), GET(FOOTER(bp)) & ~SAMPLED);
+            *link = b->next;
+            b->stack->inuse_objs--;
+            b->stack->inuse_bytes -= b->size;
+            b->next = prof_spare;
+            prof_spare = b;
+            if (size != NULL)
+                *size = b->size;
+            return b->stack;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * prof_relink - Undo prof_forget(bp) for a realloc that failed: bp is live
+ *               again with the sample it had, size bytes from stack st.
+ *               The allocation counts never went down, so they stay.
+ */
+static void prof_relink(void* bp, prof_stack_t* st, size_t size) {
+    prof_block_t* b;
+
+    // prof_forget just put bp's entry on the spare list
+    b = prof_spare;
+    prof_spare = b->next;
+    b->bp = bp;
+    b->size = size;
+    b->stack = st;
+    b->next = prof_blocks[PROF_SLOT(bp)];
+    prof_blocks[PROF_SLOT(bp)] = b;
+    st->inuse_objs++;
+    st->inuse_bytes += size;
+    SET_INT(HEADER(bp), GET(HEADER(bp)) | SAMPLED);
+    SET_INT(FOOTER(bp), GET(FOOTER(bp)) | SAMPLED);
+}
+
+/*
+ * prof_reset - Heap h is being thrown away, so nothing sampled in it is live
+ *              any more. The cumulative allocation counts are kept.
+ */
+static void prof_reset(mm_heap_t* h) {
+    prof_block_t** link;
+    prof_block_t* b;
+    int i;
+
+    for (i = 0; i < PROF_SLOTS; i++) {
+        link = &prof_blocks[i];
+        while ((b = *link) != NULL) {
+            if (heap_of(b->bp) != h) {
+                link = &b->next;
+                continue;
+            }
+            *link = b->next;
+            b->stack->inuse_objs--;
+            b->stack->inuse_bytes -= b->size;
+            b->next = prof_spare;
+            prof_spare = b;
+        }
+    }
+    prof_left = prof_next();
+}
+
+/*
+ * mm_prof_rate - Sample about one allocation per bytes allocated (0 = off)
+ */
+void mm_prof_rate(size_t bytes) {
+    LOCK();
+    prof_rate = bytes;
+    prof_left = prof_next();
+    UNLOCK();
+}
+
+/*
+ * mm_prof_dump - Write the sampled heap, one line per call stack, in the
+ *                legacy pprof heap format. pprof scales the sampled counts
+ *                back up using the heap_v2 rate in the first line.
+ */
+int mm_prof_dump(FILE* fp) {
+    prof_stack_t* st;
+    unsigned long inuse_objs = 0, alloc_objs = 0;
+    unsigned long long inuse_bytes = 0, alloc_bytes = 0;
+    FILE* maps;
+    char line[512];
+    int i, j;
+
+    LOCK();
+    for (i = 0; i < PROF_BUCKETS; i++) {
+        for (st = prof_stacks[i]; st != NULL; st = st->next) {
+            inuse_objs += st->inuse_objs;
+            inuse_bytes += st->inuse_bytes;
+            alloc_objs += st->alloc_objs;
+            alloc_bytes += st->alloc_bytes;
+        }
+    }
+    fprintf(fp, "heap profile: %6lu: %8llu [%6lu: %8llu] @ heap_v2/%lu\n",
+            inuse_objs, inuse_bytes, alloc_objs, alloc_bytes, (unsigned long)prof_rate);
+    for (i = 0; i < PROF_BUCKETS; i++) {
+        for (st = prof_stacks[i]; st != NULL; st = st->next) {
+            fprintf(fp, "%6lu: %8llu [%6lu: %8llu] @",
+                    st->inuse_objs, st->inuse_bytes, st->alloc_objs, st->alloc_bytes);
+            for (j = 0; j < st->depth; j++)
+                fprintf(fp, " %p", st->pc[j]);
+            fprintf(fp, "\n");
+        }
+    }
+    UNLOCK();
+
+    // pprof needs the mappings to symbolize the addresses
+    fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+    if ((maps = fopen("/proc/self/maps", "r")) != NULL) {
+        while (fgets(line, sizeof(line), maps) != NULL)
+            fputs(line, fp);
+        fclose(maps);
+    }
+    return ferror(fp) ? -1 : 0;
 }
 
 /* 
- * erase - Removes the new segment from the freelist.
+ * erase - Removes the new segment from its freelist. The block's tags must
+ *         still hold the size it was pushed with.
  */
 static void erase(void* delNode) {
 	if (PREV_PTR(delNode)) {
 		SET_PTR(NEXT_PTR(PREV_PTR(delNode)), NEXT_PTR(delNode));
 	
 	} else {
-		freelist_head = NEXT_PTR(delNode);
+		int c = list_of(GET_SIZE(HEADER(delNode)));
 
+		heap->freelist_head[c] = NEXT_PTR(delNode);
+		if (IS_ALLOC(HEADER(NEXT_PTR(delNode))))
+			bitmap_clear(heap->list_map, c);
 	}
 
 	SET_PTR(PREV_PTR(NEXT_PTR(delNode)), PREV_PTR(delNode));
+	heap->free_bytes -= GET_SIZE(HEADER(delNode));
+	heap->free_blocks--;
+	if (delNode == heap->bg_next)
+		heap->bg_next = NULL;
 }
@@ -4,6 +4,195 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+
+/*
+ * Independent heaps. Each mm_heap_create'd heap grows in a memlib region
+ * of its own, so its blocks stay together and mm_heap_destroy drops them
+ * all at once, or mm_heap_reset empties it and keeps its region for
+ * reuse. mm_heap_malloc(NULL, n) is mm_malloc(n). mm_free and
+ * mm_realloc take a block from any heap and keep it there; mm_init
+ * resets only the main heap. mm_stats, mm_check and the walks cover
+ * every heap.
+ */
+typedef struct mm_heap mm_heap_t;
+
+extern mm_heap_t *mm_heap_create(void);
+extern void *mm_heap_malloc(mm_heap_t *h, size_t size);
+extern void mm_heap_destroy(mm_heap_t *h);
+extern int mm_heap_reset(mm_heap_t *h);
+
+/*
+ * NUMA mode. After mm_set_numa(1), mm_init sets up an arena (a heap
+ * whose pages are bound to the node) for every NUMA node, and mm_malloc
+ * takes memory from the arena of the node the calling thread runs on;
+ * blocks are freed back to the arena they came from. mm_numa_nodes
+ * reports how many arenas there are, 1 on a single-node machine.
+ */
+extern void mm_set_numa(int on);
+extern int mm_numa_nodes(void);
+
+/*
+ * Cache-line-aware placement. Under MM_PLACE_THREAD (set with
+ * mm_set_placement, effective from the next mm_init) every thread gets
+ * its small blocks from a heap of its own, so no two threads' small
+ * objects share a cache line. mm_malloc_hot returns a block that starts
+ * on an MM_CACHELINE boundary and has its lines to itself, for objects
+ * one thread writes often; mm_realloc keeps its contents, not its
+ * alignment. The debug build ignores the alignment.
+ */
+#define MM_CACHELINE      64
+#define MM_PLACE_SHARED   0  /* one heap for everybody (default) */
+#define MM_PLACE_THREAD   1  /* small blocks from per-thread heaps */
+
+extern void mm_set_placement(int mode);
+extern void *mm_malloc_hot(size_t size);
+
+/*
+ * Small-block caches, in the thread-safe build. After mm_set_cache and
+ * the next mm_init, mm_malloc and mm_free serve small blocks from a
+ * cache without taking the lock. MM_CACHE_CPU keeps a cache per CPU,
+ * updated with Linux restartable sequences (rseq) and no atomics, so
+ * the memory cached is bounded by the number of CPUs; where rseq is not
+ * available (on anything but x86-64, so in the -m32 build too) it falls
+ * back to MM_CACHE_THREAD, a cache per thread.
+ * Cached blocks count as allocated in mm_stats and the heap walks.
+ * Caching is off while a placement or NUMA mode steers mallocs, with
+ * self-checking or the profiler on, and in the debug build.
+ * mm_cache_mode reports the mode in effect.
+ */
+#define MM_CACHE_OFF      0  /* no caches (default) */
+#define MM_CACHE_THREAD   1  /* a cache per thread */
+#define MM_CACHE_CPU      2  /* a cache per CPU, else per thread */
+
+extern void mm_set_cache(int mode);
+extern int mm_cache_mode(void);
+
+/*
+ * Allocator knobs by name. mm_ctl stores the current value of knob name
+ * in *oldp (unless oldp is NULL), then sets it to *newp (unless newp is
+ * NULL). Values are size_t. It returns 0, or -1 for an unknown name, a
+ * value out of range or a knob that can't be set (or read) that way.
+ * mm_ctl_parse sets a knob from "name=value", the value a decimal
+ * number with an optional k, m or g suffix, or for "engine" an engine's
+ * name; a value too big for a size_t is rejected. mm_ctl_env sets those
+ * listed, comma-separated, in $MM_OPTIONS, the first time it is called;
+ * the first mm_init calls it, so call it earlier to let explicit
+ * settings override the environment.
+ *
+ *   grow.chunk   least the heap grows by (4096)
+ *   split.min    least remainder split off a free block (16)
+ *   engine       the engine for the next mm_init, by mm_engine_name index
+ *   cache.mode   MM_CACHE_* for the next mm_init, as mm_set_cache
+ *   cache.bytes  most bytes per size class in a small-block cache (2048)
+ *
+ * The background thread does the upkeep that would otherwise add
+ * latency to mallocs and frees: it returns the pages inside large free
+ * blocks (the one at the top of the heap too) and those committed past
+ * the top, decays the per-CPU caches, and commits and faults in memory
+ * ahead of the heap while it grows. It takes the lock for one free
+ * list, and a bounded number of its blocks, at a time. It needs the
+ * thread-safe build; "bg.run" does one pass in the caller, in any
+ * build, but leaves the per-CPU caches alone, as decaying them means
+ * moving to every CPU in turn.
+ *
+ *   bg.enable    1 starts the background thread, 0 stops it and waits
+ *                for it to finish (do that before mem_reset_brk)
+ *   bg.interval  milliseconds between passes (100)
+ *   bg.run       (write only) do one pass now, without the cache decay
+ *   bg.purge     smallest free block whose pages are returned, 0 = off
+ *   bg.ahead     most bytes faulted in ahead of a growing heap, 0 = off
+ *   bg.trim      passes a heap must go without growing before the pages
+ *                committed past its top are returned, 0 = off (10);
+ *                independent of bg.purge
+ *   bg.decay     percent of each per-CPU cache freed per pass (50)
+ *   bg.passes    (read only) passes done so far
+ *   bg.purged    (read only) bytes returned so far
+ */
+extern int mm_ctl(const char *name, void *oldp, const void *newp);
+extern int mm_ctl_parse(const char *opt);
+extern void mm_ctl_env(void);
+
+/*
+ * Heap iteration for tooling. mm_heap_walk calls fn once for every block
+ * in the heap, in address order, with the allocator lock held (so fn
+ * must not call back into mm). mm_freelists stores the length of each
+ * free list in lengths[0..n-1] and returns how many lists there are.
+ */
+typedef struct {
+    void *payload;      /* block pointer, as returned by mm_malloc */
+    size_t size;        /* total block size, including boundary tags */
+    size_t overhead;    /* bytes of the block taken by boundary tags */
+    int allocated;      /* 1 if allocated, 0 if free */
+} mm_block_t;
+
+typedef void (*mm_walk_fn)(const mm_block_t *blk, void *arg);
+
+extern void mm_heap_walk(mm_walk_fn fn, void *arg);
+extern int mm_freelists(size_t *lengths, int n);
+
+/*
+ * Allocator health counters, cheap enough to sample from a monitoring
+ * thread: the counts are maintained as blocks change state, and only
+ * the highest non-empty free list is scanned, for largest_free.
+ */
+struct mm_stats {
+    size_t allocated;       /* bytes in allocated blocks, including tags */
+    size_t free;            /* bytes in free blocks */
+    size_t free_blocks;     /* number of free blocks */
+    size_t largest_free;    /* size of the largest free block */
+    size_t heap;            /* bytes obtained from mem_sbrk */
+    unsigned long mallocs;  /* calls to mm_malloc */
+    unsigned long frees;    /* calls to mm_free */
+    unsigned long reallocs; /* calls to mm_realloc */
+};
+
+extern void mm_stats(struct mm_stats *st);
+
+/*
+ * Heap consistency checking. mm_check walks the whole heap and the free
+ * list and returns the number of problems found (0 if consistent),
+ * describing each on stderr if verbose. mm_set_check makes the allocator
+ * check itself after every op and abort() at the first problem, so a
+ * corruption crashes next to its cause rather than far away from it.
+ */
+#define MM_CHECK_OFF  0  /* no checking (default) */
+#define MM_CHECK_INCR 1  /* check only the blocks each op touched */
+#define MM_CHECK_FULL 2  /* run mm_check after each op */
+
+extern int mm_check(int verbose);
+extern void mm_set_check(int level);
+
+/*
+ * The debug build (make DEBUG=1) puts a canary after every payload and
+ * checks it on free, poisons freed blocks and quarantines them before
+ * reuse. mm_set_guard additionally places blocks of at least min_size
+ * bytes right below a PROT_NONE guard page (0 = off, the default). It
+ * returns 0, or -1 in a regular build, which has no guard pages, for
+ * any min_size but 0.
+ */
+extern int mm_set_guard(size_t min_size);
+
+/*
+ * Sampling heap profiler. After mm_prof_rate(n) mm records the call
+ * stack of about one allocation per n bytes allocated (Poisson sampled,
+ * so large blocks are proportionally more likely to be picked); 0 turns
+ * it off, the default. mm_prof_dump writes the sampled live heap by
+ * stack in the legacy pprof heap format ("pprof mdriver file.heap").
+ */
+extern void mm_prof_rate(size_t bytes);
+extern int mm_prof_dump(FILE *fp);
+
+/*
+ * Allocator engines. Every combination of fit (first/best), free list
+ * order (lifo/addr), coalescing (now/defer) and heap growth (chunk/exact/
+ * adapt) is compiled in as a separate engine, named like "first_lifo_now_chunk"
+ * (the default). mm_engine_name(i) returns the name of engine i, or NULL
+ * past the last; mm_set_engine returns -1 for an unknown name and takes
+ * effect at the next mm_init.
+ */
+extern const char *mm_engine_name(int i);
+extern int mm_set_engine(const char *name);
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -0,0 +1,142 @@
+/*
+ * perfctr.c - hardware performance counters via perf_event_open
+ *
+ * Only user-space events are counted (exclude_kernel), which keeps the
+ * counters usable at the default perf_event_paranoid level of 2. On
+ * systems without perf_event_open every counter reports invalid.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "perfctr.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static char *names[PERF_NEVENTS] = {
+    "cycles", "instrs", "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss"
+};
+
+static int fds[PERF_NEVENTS] = {-1, -1, -1, -1, -1, -1};
+
+#ifdef __linux__
+/* Encode a generic cache event as perf_event_attr.config expects it */
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+/*
+ * open_event - Open one counter on the calling thread, disabled
+ */
+static int open_event(unsigned type, unsigned long long config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | 
+	PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/*
+ * perf_init - Open every counter we can. Return how many opened.
+ */
+int perf_init(void)
+{
+    int i, n = 0;
+
+#ifdef __linux__
+    fds[PERF_CYCLES] = open_event(PERF_TYPE_HARDWARE, 
+				  PERF_COUNT_HW_CPU_CYCLES);
+    fds[PERF_INSTRUCTIONS] = open_event(PERF_TYPE_HARDWARE, 
+					PERF_COUNT_HW_INSTRUCTIONS);
+    fds[PERF_L1D_MISSES] = open_event(PERF_TYPE_HW_CACHE, 
+	CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+		    PERF_COUNT_HW_CACHE_RESULT_MISS));
+    fds[PERF_LLC_MISSES] = open_event(PERF_TYPE_HW_CACHE, 
+	CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+		    PERF_COUNT_HW_CACHE_RESULT_MISS));
+    fds[PERF_DTLB_MISSES] = open_event(PERF_TYPE_HW_CACHE, 
+	CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+		    PERF_COUNT_HW_CACHE_RESULT_MISS));
+    fds[PERF_BRANCH_MISSES] = open_event(PERF_TYPE_HARDWARE, 
+					 PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+
+    for (i = 0; i < PERF_NEVENTS; i++)
+	if (fds[i] >= 0)
+	    n++;
+    return n;
+}
+
+/*
+ * perf_deinit - Close all counters
+ */
+void perf_deinit(void)
+{
+    int i;
+
+    for (i = 0; i < PERF_NEVENTS; i++) {
+	if (fds[i] >= 0)
+	    close(fds[i]);
+	fds[i] = -1;
+    }
+}
+
+/*
+ * perf_start - Reset and enable all open counters
+ */
+void perf_start(void)
+{
+#ifdef __linux__
+    int i;
+
+    for (i = 0; i < PERF_NEVENTS; i++) {
+	if (fds[i] < 0)
+	    continue;
+	ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/*
+ * perf_stop - Disable the counters and read them. Counts are scaled up
+ *    by enabled/running time in case the kernel had to multiplex them.
+ */
+void perf_stop(perf_counts_t *c)
+{
+    int i;
+    uint64_t buf[3]; /* value, time enabled, time running */
+
+    memset(c, 0, sizeof(perf_counts_t));
+    for (i = 0; i < PERF_NEVENTS; i++) {
+	if (fds[i] < 0)
+	    continue;
+#ifdef __linux__
+	ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+	if (read(fds[i], buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0)
+	    continue;
+	c->valid[i] = 1;
+	c->count[i] = (buf[2] < buf[1]) ? 
+	    (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+    }
+}
+
+/*
+ * perf_name - Short column name for event i
+ */
+const char *perf_name(int i)
+{
+    return names[i];
+}
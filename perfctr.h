@@ -0,0 +1,39 @@
+/*
+ * perfctr.h - hardware performance counters via perf_event_open (Linux)
+ *
+ * Each counter is opened on its own rather than as a group, so a CPU or
+ * VM that lacks one event still reports the others. Counters that could
+ * not be opened are marked invalid and printed as "-".
+ */
+#include <stdint.h>
+
+/* The events we count, in reporting order */
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NEVENTS
+};
+
+typedef struct {
+    int valid[PERF_NEVENTS];       /* was this counter available? */
+    uint64_t count[PERF_NEVENTS];  /* event count, scaled if multiplexed */
+} perf_counts_t;
+
+/* Open the counters for this thread. Return how many could be opened */
+int perf_init(void);
+
+/* Close all counters */
+void perf_deinit(void);
+
+/* Reset and enable the counters */
+void perf_start(void);
+
+/* Disable the counters and read them into c */
+void perf_stop(perf_counts_t *c);
+
+/* Short column name for event i */
+const char *perf_name(int i);